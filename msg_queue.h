@@ -13,6 +13,13 @@
 #define MAX_MSG_SIZE   65536
 #define MAX_QUEUE_SIZE 1024
 
+// The device moves one message per iovec only for a readv or writev of a user iovec array of more than one
+// segment, every iovec read then holds a storage record (size followed by the message). Any other I/O,
+// a registered io_uring buffer (READ_FIXED, WRITE_FIXED) included, is a single message in a flat buffer
+
+// Storage record size flag, the rest of the size is the distance to the record with the same message
+#define MSG_QUEUE_BACKREF ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
 #define EEMPTY 29 // ESPIPE /* Illegal seek */
 #define EFULL  27 // EFBIG  /* File too large */
 
@@ -23,4 +30,94 @@
 #define MSG_QUEUE_LOAD_ASYNC _IOR(MSG_QUEUE_MAGIC_NO, 2, char*)
 #define MSG_QUEUE_SAVE_ASYNC _IOR(MSG_QUEUE_MAGIC_NO, 3, char*)
 
+#define MAX_FILTER_SIZE 256
+
+#define MSG_QUEUE_FILTER_ANYWHERE 0x1 // look for the pattern at any position starting from the offset
+#define MSG_QUEUE_FILTER_INVERT   0x2 // accept the messages which don't match the pattern
+#define MSG_QUEUE_FILTER_DROP     0x4 // discard rejected messages instead of leaving them to other readers
+
+// Per-descriptor read filter, a zero size detaches the filter
+struct msg_queue_filter_t
+{
+	unsigned int flags;
+	unsigned int offset;
+	unsigned int size;
+	unsigned char pattern[MAX_FILTER_SIZE];
+};
+
+#define MSG_QUEUE_SET_FILTER _IOW(MSG_QUEUE_MAGIC_NO, 4, struct msg_queue_filter_t)
+
+// Busy poll budget in microseconds for blocking reads of the descriptor, zero disables busy polling
+#define MSG_QUEUE_SET_BUSY_POLL _IOW(MSG_QUEUE_MAGIC_NO, 6, unsigned int)
+
+#define MSG_QUEUE_MAX_NODES 8
+
+struct msg_queue_stat_t
+{
+	unsigned long long elems;      // messages held by the module
+	unsigned long long elem_bytes; // their total size
+	unsigned long long blobs;      // distinct payloads actually allocated
+	unsigned long long blob_bytes; // their total size, elem_bytes / blob_bytes is the dedup ratio
+	unsigned long long dedup_hits; // messages which reused an existing payload
+	unsigned long long node_local[MSG_QUEUE_MAX_NODES];  // messages read on the node their memory belongs to
+	unsigned long long node_remote[MSG_QUEUE_MAX_NODES]; // messages read across the nodes
+	unsigned long long spilled;    // messages moved to the spill file under memory pressure
+	unsigned long long busy_polls;     // blocking reads which busy polled before sleeping
+	unsigned long long busy_poll_hits; // the ones which got a message without sleeping
+};
+
+#define MSG_QUEUE_STAT _IOR(MSG_QUEUE_MAGIC_NO, 5, struct msg_queue_stat_t)
+
+#define MSG_QUEUE_MAX_TENANTS 64
+
+struct msg_queue_tenant_stat_t
+{
+	unsigned int uid;
+	unsigned long long msgs;      // messages of the user in the queue
+	unsigned long long bytes;     // their total size
+	unsigned long long rejected;  // pushes rejected for exceeding the quota
+	unsigned long long throttled; // pushes delayed or refused by the rate limit
+};
+
+struct msg_queue_tenants_t
+{
+	unsigned int count;
+	struct msg_queue_tenant_stat_t tenants[MSG_QUEUE_MAX_TENANTS];
+};
+
+#define MSG_QUEUE_TENANTS _IOR(MSG_QUEUE_MAGIC_NO, 7, struct msg_queue_tenants_t)
+
+#define MSG_QUEUE_PEEK_NEWEST 0x1 // peek at the newest message instead of the oldest one
+
+// Copies a message without taking it from the queue, spilled messages aren't visible
+struct msg_queue_peek_t
+{
+	unsigned long long cursor; // browse: the message to continue after, 0 - from the oldest one; set to the message copied
+	void* buffer;
+	unsigned int size;         // the buffer size, set to the message size which may be larger
+	unsigned int flags;
+};
+
+// Both fail with EEMPTY when there is no message to copy. Browsing continues from the oldest
+// message when the cursor one has already left the queue
+#define MSG_QUEUE_PEEK   _IOWR(MSG_QUEUE_MAGIC_NO, 8, struct msg_queue_peek_t)
+#define MSG_QUEUE_BROWSE _IOWR(MSG_QUEUE_MAGIC_NO, 9, struct msg_queue_peek_t)
+
+#define MSG_QUEUE_MAX_PARTITIONS 64
+#define MAX_KEY_SIZE 256
+
+// The following writes of the descriptor go to the partition of the key, a zero size returns them to the shared queue.
+// Every partition holds up to MAX_QUEUE_SIZE / partitions messages
+struct msg_queue_key_t
+{
+	unsigned int size;
+	unsigned char key[MAX_KEY_SIZE];
+};
+
+#define MSG_QUEUE_SET_KEY _IOW(MSG_QUEUE_MAGIC_NO, 10, struct msg_queue_key_t)
+
+// The descriptor joins the consumer group and reads only the partitions it owns until it is closed,
+// the read filter doesn't apply to them
+#define MSG_QUEUE_JOIN _IO(MSG_QUEUE_MAGIC_NO, 11)
+
 #endif // MSG_QUEUE_H
@@ -1,6 +1,4 @@
-#include "msg_queue.h"
-
-#include <sys/ioctl.h>
+#include "msg_queue_lib.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,6 +17,11 @@
 #define CMD_A_SV "6"
 #define CMD_STRT "7"
 #define CMD_STOP "8"
+#define CMD_STAT "9"
+
+#define BULK_BATCH  256             // messages per push or pop call
+#define BULK_BUFFER (4 * 1024 * 1024) // bytes of messages collected for a push call
+#define BULK_OUTPUT (1024 * 1024)     // stdout buffer size
 
 int read_ch()
 {
@@ -27,7 +30,7 @@ int read_ch()
 	return res;
 }
 
-int cmd_pop_(int fd)
+int cmd_pop_(struct msg_queue_t* queue)
 {
 	ssize_t ret;
 	char buffer[MAX_MSG_SIZE + 1];
@@ -37,7 +40,7 @@ int cmd_pop_(int fd)
 	do
 	{
 		printf("Poping message from the kernel module message queue...\n");
-		ret = read(fd, buffer, MAX_MSG_SIZE);
+		ret = msg_queue_pop(queue, buffer, MAX_MSG_SIZE);
 		if (ret < 0)
 		{
 			perror("Failed to read the message from the device");
@@ -54,7 +57,7 @@ int cmd_pop_(int fd)
 	return ret;
 }
 
-int cmd_push(int fd)
+int cmd_push(struct msg_queue_t* queue)
 {
 	ssize_t ret;
     char buffer[MAX_MSG_SIZE + 1];
@@ -65,7 +68,7 @@ int cmd_push(int fd)
 		printf("Type in a short string to push to the kernel module message queue:\n");
         scanf("%"_S(MAX_MSG_SIZE)"[^\n]%*c", buffer);
 		printf("Pushing message into the queue [%s].\n", buffer);
-		ret = write(fd, buffer, strlen(buffer));
+		ret = msg_queue_push(queue, buffer, strlen(buffer));
 		if (ret < 0)
 		{
 			perror("Failed to write the message to the device");
@@ -80,7 +83,7 @@ int cmd_push(int fd)
 	return ret;
 }
 
-int cmd_load(int fd, int async)
+int cmd_load(struct msg_queue_t* queue, int async)
 {
 	ssize_t ret;
 	char buffer[PATH_MAX + 1];
@@ -90,7 +93,7 @@ int cmd_load(int fd, int async)
 	printf("Type in the input file path:\n");
 	scanf("%"_S(PATH_MAX)"[^\n]%*c", buffer);
 
-    ret = ioctl(fd, async ? MSG_QUEUE_LOAD_ASYNC : MSG_QUEUE_LOAD, buffer);
+    ret = msg_queue_load(queue, buffer, async);
 
 	if (ret < 0)
 	{
@@ -105,7 +108,7 @@ int cmd_load(int fd, int async)
 	return ret;
 }
 
-int cmd_save(int fd, int async)
+int cmd_save(struct msg_queue_t* queue, int async)
 {
 	ssize_t ret;
     char buffer[PATH_MAX + 1];
@@ -115,7 +118,7 @@ int cmd_save(int fd, int async)
 	printf("Type in the output file path:\n");
     scanf("%"_S(PATH_MAX)"[^\n]%*c", buffer);
 
-    ret = ioctl(fd, async ? MSG_QUEUE_SAVE_ASYNC : MSG_QUEUE_SAVE, buffer);
+    ret = msg_queue_save(queue, buffer, async);
 
 	if (ret < 0)
 	{
@@ -150,19 +153,404 @@ int cmd_stop()
     return ret;
 }
 
-int main()
+void cmd_tenants(struct msg_queue_t* queue, int plain)
+{
+	struct msg_queue_tenants_t tenants;
+	unsigned int i;
+
+	if (msg_queue_ioctl(queue, MSG_QUEUE_TENANTS, &tenants) < 0) return;
+
+	for (i = 0; i < tenants.count; i++)
+	{
+		struct msg_queue_tenant_stat_t* tenant = &tenants.tenants[i];
+		if (plain) printf("uid%u_msgs %llu\nuid%u_bytes %llu\nuid%u_rejected %llu\nuid%u_throttled %llu\n",
+			tenant->uid, tenant->msgs, tenant->uid, tenant->bytes, tenant->uid, tenant->rejected, tenant->uid, tenant->throttled);
+		else printf("User %u:         %llu messages (%llu bytes), %llu rejected, %llu throttled\n",
+			tenant->uid, tenant->msgs, tenant->bytes, tenant->rejected, tenant->throttled);
+	}
+}
+
+int cmd_stat(struct msg_queue_t* queue)
+{
+	int ret;
+	int node;
+	struct msg_queue_stat_t stat;
+
+	printf("\e[1;1H\e[2J"); // clear
+
+	ret = msg_queue_stat(queue, &stat);
+
+	if (ret < 0)
+	{
+		perror("Failed to get the message queue statistics");
+	}
+	else
+	{
+		printf("Messages:         %llu (%llu bytes)\n", stat.elems, stat.elem_bytes);
+		printf("Stored payloads:  %llu (%llu bytes)\n", stat.blobs, stat.blob_bytes);
+		printf("Deduplicated:     %llu\n", stat.dedup_hits);
+		printf("Dedup ratio:      %.2f\n", stat.blob_bytes ? (double)stat.elem_bytes / stat.blob_bytes : 1.0);
+		printf("Spilled:          %llu\n", stat.spilled);
+		printf("Busy polls:       %llu (%llu hits)\n", stat.busy_polls, stat.busy_poll_hits);
+		for (node = 0; node < MSG_QUEUE_MAX_NODES; node++)
+		{
+			if (!stat.node_local[node] && !stat.node_remote[node]) continue;
+			printf("Node %d reads:     %llu local, %llu remote\n", node, stat.node_local[node], stat.node_remote[node]);
+		}
+		cmd_tenants(queue, 0);
+	}
+
+	printf("Press Enter to continue...\n");
+	read_ch();
+
+	return ret;
+}
+
+struct bulk_t
+{
+	struct msg_queue_t* queue;
+	int records; // length-delimited (storage record) messages instead of newline-delimited ones
+	char* buffer;
+	size_t used;
+	struct iovec msgs[BULK_BATCH];
+	int count;
+	unsigned long long total;
+};
+
+// Pushes the collected messages, waiting while the queue is full or the push rate of the user is exceeded.
+// Returns an errno code on failure
+int bulk_flush(struct bulk_t* bulk)
+{
+	int pushed = 0;
+
+	while (pushed < bulk->count)
+	{
+		ssize_t ret = msg_queue_push_batch(bulk->queue, bulk->msgs + pushed, bulk->count - pushed);
+		if (ret < 0)
+		{
+			if ((errno != EFULL) && (errno != EAGAIN))
+			{
+				int err = errno;
+				perror("Failed to push messages");
+				return err;
+			}
+			ret = 0;
+		}
+		pushed += ret;
+		if (pushed < bulk->count) usleep(1000);
+	}
+
+	bulk->total += bulk->count;
+	bulk->count = 0;
+	bulk->used = 0;
+	return 0;
+}
+
+int bulk_add(struct bulk_t* bulk, const char* msg, size_t size)
+{
+	if (size > MAX_MSG_SIZE) size = MAX_MSG_SIZE;
+	if ((bulk->count == BULK_BATCH) || (bulk->used + size > BULK_BUFFER))
+	{
+		int ret = bulk_flush(bulk);
+		if (ret) return ret;
+	}
+
+	memcpy(bulk->buffer + bulk->used, msg, size);
+	bulk->msgs[bulk->count].iov_base = bulk->buffer + bulk->used;
+	bulk->msgs[bulk->count].iov_len = size;
+	bulk->used += size;
+	bulk->count++;
+	return 0;
+}
+
+int bulk_push_file(struct bulk_t* bulk, FILE* in)
+{
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t len;
+	int ret = 0;
+
+	if (bulk->records)
+	{
+		size_t size;
+		line = malloc(MAX_MSG_SIZE);
+		if (!line) return ENOMEM;
+
+		while (!ret)
+		{
+			size_t got = fread(&size, 1, sizeof(size), in);
+			if (!got) break;
+
+			if ((got != sizeof(size)) || (size & MSG_QUEUE_BACKREF) || (size > MAX_MSG_SIZE) || (fread(line, 1, size, in) != size))
+			{
+				fprintf(stderr, "Malformed or back reference record, use the load command for SAVE files\n");
+				ret = EINVAL;
+			}
+			else ret = bulk_add(bulk, line, size);
+		}
+	}
+	else
+	{
+		while (!ret && ((len = getline(&line, &capacity, in)) >= 0))
+		{
+			if (len && (line[len - 1] == '\n')) len--;
+			ret = bulk_add(bulk, line, len);
+		}
+	}
+
+	free(line);
+	return ret;
+}
+
+int bulk_push(struct msg_queue_t* queue, int records, int argc, char* argv[])
+{
+	struct bulk_t bulk = { queue, records, malloc(BULK_BUFFER), 0, {{0}}, 0, 0 };
+	int ret = 0;
+	int i;
+
+	if (!bulk.buffer) return ENOMEM;
+
+	if (!argc) ret = bulk_push_file(&bulk, stdin);
+	for (i = 0; !ret && (i < argc); i++)
+	{
+		FILE* in = fopen(argv[i], "rb");
+		if (!in)
+		{
+			ret = errno;
+			perror(argv[i]);
+			break;
+		}
+		setvbuf(in, NULL, _IOFBF, BULK_OUTPUT);
+		ret = bulk_push_file(&bulk, in);
+		fclose(in);
+	}
+	if (!ret) ret = bulk_flush(&bulk);
+
+	fprintf(stderr, "%llu message(s) have been pushed\n", bulk.total);
+	free(bulk.buffer);
+	return ret;
+}
+
+// Pops up to max messages (all of them for a negative max) to stdout
+int bulk_pop(struct msg_queue_t* queue, int records, long long max)
+{
+	char* buffer = malloc((size_t)BULK_BATCH * MSG_QUEUE_BATCH_BUFFER);
+	struct iovec msgs[BULK_BATCH];
+	unsigned long long total = 0;
+	int ret = 0;
+
+	if (!buffer) return ENOMEM;
+
+	setvbuf(stdout, NULL, _IOFBF, BULK_OUTPUT);
+
+	while ((max < 0) || (total < (unsigned long long)max))
+	{
+		int count = ((max < 0) || (max - total > BULK_BATCH)) ? BULK_BATCH : (int)(max - total);
+		ssize_t popped;
+		int i;
+
+		for (i = 0; i < count; i++)
+		{
+			msgs[i].iov_base = buffer + (size_t)i * MSG_QUEUE_BATCH_BUFFER;
+			msgs[i].iov_len = MSG_QUEUE_BATCH_BUFFER;
+		}
+
+		popped = msg_queue_pop_batch(queue, msgs, count);
+		if (popped < 0)
+		{
+			// The module is still reading spilled messages back
+			if (errno == EAGAIN)
+			{
+				usleep(1000);
+				continue;
+			}
+			if (errno != EEMPTY)
+			{
+				perror("Failed to pop messages");
+				ret = errno;
+			}
+			break;
+		}
+
+		for (i = 0; i < popped; i++)
+		{
+			if (records) fwrite(&msgs[i].iov_len, sizeof(msgs[i].iov_len), 1, stdout);
+			fwrite(msgs[i].iov_base, 1, msgs[i].iov_len, stdout);
+			if (!records) putchar('\n');
+		}
+		total += popped;
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "%llu message(s) have been popped\n", total);
+	free(buffer);
+	return ret;
+}
+
+int bulk_browse(struct msg_queue_t* queue, int records, long long max)
+{
+	char* buffer = malloc(MAX_MSG_SIZE);
+	struct msg_queue_peek_t peek = {0};
+	unsigned long long total = 0;
+	int ret = 0;
+
+	if (!buffer) return ENOMEM;
+
+	setvbuf(stdout, NULL, _IOFBF, BULK_OUTPUT);
+
+	while ((max < 0) || (total < (unsigned long long)max))
+	{
+		size_t size;
+
+		peek.buffer = buffer;
+		peek.size = MAX_MSG_SIZE;
+		if (msg_queue_ioctl(queue, MSG_QUEUE_BROWSE, &peek) < 0)
+		{
+			if (errno != EEMPTY)
+			{
+				perror("Failed to browse messages");
+				ret = errno;
+			}
+			break;
+		}
+
+		size = peek.size < MAX_MSG_SIZE ? peek.size : MAX_MSG_SIZE;
+		if (records) fwrite(&size, sizeof(size), 1, stdout);
+		fwrite(buffer, 1, size, stdout);
+		if (!records) putchar('\n');
+		total++;
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "%llu message(s) have been browsed\n", total);
+	free(buffer);
+	return ret;
+}
+
+int bulk_stat(struct msg_queue_t* queue)
 {
-	int fd;
+	struct msg_queue_stat_t stat;
+	int node;
+
+	if (msg_queue_stat(queue, &stat) < 0)
+	{
+		perror("Failed to get the message queue statistics");
+		return errno;
+	}
+
+	printf("elems %llu\nelem_bytes %llu\nblobs %llu\nblob_bytes %llu\ndedup_hits %llu\nspilled %llu\nbusy_polls %llu\nbusy_poll_hits %llu\n",
+		stat.elems, stat.elem_bytes, stat.blobs, stat.blob_bytes, stat.dedup_hits, stat.spilled, stat.busy_polls, stat.busy_poll_hits);
+	for (node = 0; node < MSG_QUEUE_MAX_NODES; node++)
+	{
+		if (!stat.node_local[node] && !stat.node_remote[node]) continue;
+		printf("node%d_local %llu\nnode%d_remote %llu\n", node, stat.node_local[node], node, stat.node_remote[node]);
+	}
+	cmd_tenants(queue, 1);
+	return 0;
+}
+
+int bulk_usage(const char* name)
+{
+	fprintf(stderr,
+		"Usage: %s                      interactive menu\n"
+		"       %s push [-l] [file...]  push messages from the files or stdin\n"
+		"       %s pop [-l] [count]     pop count messages (1 by default) to stdout, waiting for them\n"
+		"       %s drain [-l]           pop all the messages to stdout\n"
+		"       %s browse [-l] [count]  copy count messages (all by default) to stdout leaving them in the queue\n"
+		"       %s load [-a] file       replace the queue with the messages of a storage file\n"
+		"       %s save [-a] file       move the queue to the end of a storage file\n"
+		"       %s stat                 print the queue statistics\n"
+		"Messages are newline-delimited, -l switches to length-delimited storage records,\n"
+		"-a runs the request asynchronously, -k key pushes to the partition of the key,\n"
+		"-g pops from the partitions owned in the consumer group.\n",
+		name, name, name, name, name, name, name, name);
+	return EINVAL;
+}
+
+int bulk_main(int argc, char* argv[])
+{
+	const char* name = argv[0];
+	const char* cmd = argv[1];
+	struct msg_queue_t* queue;
+	struct msg_queue_key_t key = {0};
+	int records = 0;
+	int async = 0;
+	int group = 0;
+	int ret = 0;
+	int opt;
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "lak:g")) != -1)
+	{
+		if (opt == 'l') records = 1; else
+		if (opt == 'a') async = 1; else
+		if ((opt == 'k') && (strlen(optarg) <= MAX_KEY_SIZE))
+		{
+			key.size = strlen(optarg);
+			memcpy(key.key, optarg, key.size);
+		} else
+		if (opt == 'g') group = 1; else
+		return bulk_usage(name);
+	}
+	argc -= optind;
+	argv += optind;
+
+	queue = msg_queue_open(NULL, !strcmp(cmd, "pop") ? O_RDWR : O_RDWR | O_NONBLOCK);
+	if (!queue)
+	{
+		perror("Failed to open the message queue");
+		return errno;
+	}
+
+	if ((key.size && (msg_queue_ioctl(queue, MSG_QUEUE_SET_KEY, &key) < 0))
+		|| (group && (msg_queue_ioctl(queue, MSG_QUEUE_JOIN, NULL) < 0)))
+	{
+		ret = errno;
+		perror("Failed to set up the partitions");
+		msg_queue_close(queue);
+		return ret;
+	}
+
+	if (!strcmp(cmd, "push")) ret = bulk_push(queue, records, argc, argv); else
+	if (!strcmp(cmd, "pop") && (argc <= 1)) ret = bulk_pop(queue, records, argc ? atoll(argv[0]) : 1); else
+	if (!strcmp(cmd, "drain") && !argc) ret = bulk_pop(queue, records, -1); else
+	if (!strcmp(cmd, "browse") && (argc <= 1)) ret = bulk_browse(queue, records, argc ? atoll(argv[0]) : -1); else
+	if (!strcmp(cmd, "load") && (argc == 1))
+	{
+		ssize_t count = msg_queue_load(queue, argv[0], async);
+		if (count < 0) { perror("Failed to load messages"); ret = errno; }
+		else if (!async) fprintf(stderr, "%zd message(s) have been loaded to the message queue\n", count);
+	} else
+	if (!strcmp(cmd, "save") && (argc == 1))
+	{
+		ssize_t count = msg_queue_save(queue, argv[0], async);
+		if (count < 0) { perror("Failed to save messages"); ret = errno; }
+		else if (!async) fprintf(stderr, "%zd message(s) have been written to the file\n", count);
+	} else
+	if (!strcmp(cmd, "stat") && !argc) ret = bulk_stat(queue); else
+	{
+		ret = bulk_usage(name);
+	}
+
+	msg_queue_close(queue);
+	return ret;
+}
+
+int main(int argc, char* argv[])
+{
+	struct msg_queue_t* queue;
 	int ret;
 	int cmd;
 
+	if (argc > 1) return bulk_main(argc, argv);
+
 	printf("Starting device test code example...\n");
 
-    fd = open("/dev/"DEVICE_NAME, O_RDWR | O_NONBLOCK);
+    queue = msg_queue_open(NULL, O_RDWR | O_NONBLOCK);
 
-	if (fd < 0)
+	if (!queue)
 	{
-		perror("Failed to open the device...");
+		perror("Failed to open the message queue...");
 		return errno;
 	}
 
@@ -178,6 +566,7 @@ int main()
         printf(CMD_A_SV ". Save messages asynchronously\n");
 		printf(CMD_STRT ". Start pop service\n");
 		printf(CMD_STOP ". Stop pop service\n");
+		printf(CMD_STAT ". Show statistics\n");
 
         printf("\n" CMD_EXIT ". Exit\n");
 
@@ -185,20 +574,21 @@ int main()
 
 		while((cmd = read_ch()) != *CMD_EXIT)
 		{
-            if (cmd == *CMD_POP_) { ret = cmd_pop_(fd);    break; } else
-            if (cmd == *CMD_PUSH) { ret = cmd_push(fd);    break; } else
-            if (cmd == *CMD_LOAD) { ret = cmd_load(fd, 0); break; } else
-            if (cmd == *CMD_A_LD) { ret = cmd_load(fd, 1); break; } else
-            if (cmd == *CMD_SAVE) { ret = cmd_save(fd, 0); break; } else
-            if (cmd == *CMD_A_SV) { ret = cmd_save(fd, 1); break; } else
-			if (cmd == *CMD_STRT) { ret = cmd_strt();      break; } else
-			if (cmd == *CMD_STOP) { ret = cmd_stop();      break; } else
+            if (cmd == *CMD_POP_) { ret = cmd_pop_(queue);    break; } else
+            if (cmd == *CMD_PUSH) { ret = cmd_push(queue);    break; } else
+            if (cmd == *CMD_LOAD) { ret = cmd_load(queue, 0); break; } else
+            if (cmd == *CMD_A_LD) { ret = cmd_load(queue, 1); break; } else
+            if (cmd == *CMD_SAVE) { ret = cmd_save(queue, 0); break; } else
+            if (cmd == *CMD_A_SV) { ret = cmd_save(queue, 1); break; } else
+			if (cmd == *CMD_STRT) { ret = cmd_strt();         break; } else
+			if (cmd == *CMD_STOP) { ret = cmd_stop();         break; } else
+			if (cmd == *CMD_STAT) { ret = cmd_stat(queue);    break; } else
             {}
 		}
 	}
 	while(cmd != *CMD_EXIT);
 
-	close(fd);
+	msg_queue_close(queue);
 
 	printf("End of the program\n");
 	return 0;
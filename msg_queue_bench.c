@@ -0,0 +1,178 @@
+#include "msg_queue.h"
+
+#include <sys/ioctl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define BENCH_TAG "msg_queue_bench"
+
+struct bench_t
+{
+	int count;
+	int interval;  // us between pushes
+	unsigned int busy_poll;
+	long long* latencies;
+};
+
+long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int cmp_ll(const void* a, const void* b)
+{
+	long long l = *(const long long*)a;
+	long long r = *(const long long*)b;
+	return (l > r) - (l < r);
+}
+
+void* consume(void* arg)
+{
+	struct bench_t* bench = arg;
+	struct msg_queue_filter_t filter = {0};
+	char buffer[MAX_MSG_SIZE];
+	int fd;
+	int i;
+
+	fd = open("/dev/"DEVICE_NAME, O_RDONLY);
+	if (fd < 0)
+	{
+		perror("Failed to open the device for reading");
+		return NULL;
+	}
+
+	// Only take the benchmark messages, anything else stays in the queue
+	filter.size = strlen(BENCH_TAG);
+	memcpy(filter.pattern, BENCH_TAG, filter.size);
+
+	if ((ioctl(fd, MSG_QUEUE_SET_FILTER, &filter) < 0) || (ioctl(fd, MSG_QUEUE_SET_BUSY_POLL, &bench->busy_poll) < 0))
+	{
+		perror("Failed to set up the reader");
+		close(fd);
+		return NULL;
+	}
+
+	for (i = 0; i < bench->count; i++)
+	{
+		long long sent;
+		ssize_t ret = read(fd, buffer, sizeof(buffer));
+		long long received = now_ns();
+
+		if (ret < (ssize_t)(sizeof(BENCH_TAG) - 1 + sizeof(sent)))
+		{
+			perror("Failed to read the message from the device");
+			break;
+		}
+
+		memcpy(&sent, buffer + sizeof(BENCH_TAG) - 1, sizeof(sent));
+		bench->latencies[i] = received - sent;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+int run(struct bench_t* bench)
+{
+	pthread_t consumer;
+	char buffer[sizeof(BENCH_TAG) - 1 + sizeof(long long)];
+	struct msg_queue_stat_t before = {0};
+	struct msg_queue_stat_t after = {0};
+	long long next;
+	int fd;
+	int i;
+
+	fd = open("/dev/"DEVICE_NAME, O_WRONLY);
+	if (fd < 0)
+	{
+		perror("Failed to open the device for writing");
+		return errno;
+	}
+
+	memset(bench->latencies, 0, bench->count * sizeof(long long));
+	pthread_create(&consumer, NULL, consume, bench);
+	usleep(100000); // let the reader block
+	ioctl(fd, MSG_QUEUE_STAT, &before);
+
+	memcpy(buffer, BENCH_TAG, sizeof(BENCH_TAG) - 1);
+	for (i = 0, next = now_ns(); i < bench->count; i++)
+	{
+		long long sent = now_ns();
+		memcpy(buffer + sizeof(BENCH_TAG) - 1, &sent, sizeof(sent));
+		if (write(fd, buffer, sizeof(buffer)) < 0)
+		{
+			perror("Failed to write the message to the device");
+			break;
+		}
+
+		// usleep() oversleeps by the timer slack, which is as long as the intervals measured
+		next += bench->interval * 1000LL;
+		while (now_ns() < next);
+	}
+
+	pthread_join(consumer, NULL);
+	ioctl(fd, MSG_QUEUE_STAT, &after);
+	close(fd);
+
+	qsort(bench->latencies, bench->count, sizeof(long long), cmp_ll);
+	printf("busy poll %6u us: min %8lld ns, p50 %8lld ns, p99 %8lld ns, max %8lld ns\n", bench->busy_poll,
+		bench->latencies[0], bench->latencies[bench->count / 2], bench->latencies[bench->count * 99 / 100],
+		bench->latencies[bench->count - 1]);
+	printf("                   %llu read(s) busy polled, %llu of them got the message without sleeping\n",
+		after.busy_polls - before.busy_polls, after.busy_poll_hits - before.busy_poll_hits);
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench_t bench = { 10000, 20, 0, NULL };
+	unsigned int busy_poll = 50;
+	int ret;
+
+	if (argc > 4)
+	{
+		printf("Usage: %s [count] [interval, us] [busy poll budget, us]\n", argv[0]);
+		return EINVAL;
+	}
+
+	if (argc > 1) bench.count = atoi(argv[1]);
+	if (argc > 2) bench.interval = atoi(argv[2]);
+	if (argc > 3) busy_poll = atoi(argv[3]);
+
+	if (bench.count <= 0)
+	{
+		printf("The message count must be positive\n");
+		return EINVAL;
+	}
+
+	// The reader doesn't spin for messages arriving less often than the budget
+	if ((bench.interval < 0) || ((unsigned int)bench.interval >= busy_poll))
+	{
+		printf("The interval must be below the busy poll budget, the reads would never spin otherwise\n");
+		return EINVAL;
+	}
+
+	bench.latencies = malloc(bench.count * sizeof(long long));
+	if (!bench.latencies) return ENOMEM;
+
+	printf("Measuring wake-to-read latency of %d messages pushed every %d us\n", bench.count, bench.interval);
+
+	if (!(ret = run(&bench)))
+	{
+		bench.busy_poll = busy_poll;
+		ret = run(&bench);
+	}
+
+	free(bench.latencies);
+	return ret;
+}
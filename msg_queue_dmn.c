@@ -1,4 +1,4 @@
-#include "msg_queue.h"
+#include "msg_queue_lib.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -9,19 +9,21 @@
 #include <unistd.h>
 #include <syslog.h>
 #include <string.h>
+#include <sys/uio.h>
 
-ssize_t pop_queue(int in, int out)
+ssize_t pop_queue(struct msg_queue_t* in, int out)
 {
     ssize_t ret;
     char buffer[MAX_MSG_SIZE];
 
-    ret = read(in, buffer, MAX_MSG_SIZE);
+    ret = msg_queue_pop(in, buffer, MAX_MSG_SIZE);
     if (ret >= 0)
     {
+        // One append per record, so the daemons of a consumer group may share the storage file
+        struct iovec record[2] = { { &ret, sizeof(ret) }, { buffer, ret } };
         ssize_t w_ret;
 
-        if (((w_ret = write(out, &ret, sizeof(ret))) < 0)
-            || ((w_ret = write(out, buffer, ret)) < 0))
+        if ((w_ret = writev(out, record, 2)) < 0)
         {
             syslog(LOG_ALERT, "failed to write storage file (error code: [%zd])", w_ret);
             return w_ret;
@@ -36,8 +38,9 @@ int main(int argc, char* argv[])
     ssize_t ret;
     pid_t pid;
     pid_t sid;
-    int in;
+    struct msg_queue_t* in;
     int out;
+    int group = (argc == 3) && !strcmp(argv[1], "-g");
 
     pid = fork();
 
@@ -66,21 +69,27 @@ int main(int argc, char* argv[])
     close(STDOUT_FILENO);
     close(STDERR_FILENO);
 
-    in = open("/dev/"DEVICE_NAME, O_RDONLY);
+    in = msg_queue_open(NULL, O_RDONLY);
 
-    if (in < 0)
+    if (!in)
     {
-        syslog(LOG_ALERT, "failed to open the device");
+        syslog(LOG_ALERT, "failed to open the message queue");
         exit(EXIT_FAILURE);
     }
 
-    if (argc != 2)
+    if (argc != 2 + group)
     {
         syslog(LOG_ALERT, "incorrect number of arguments");
         exit(EXIT_FAILURE);
     }
 
-    out = open(argv[1], O_CREAT | O_WRONLY | O_APPEND, 0666);
+    if (group && (msg_queue_ioctl(in, MSG_QUEUE_JOIN, NULL) < 0))
+    {
+        syslog(LOG_ALERT, "failed to join the consumer group");
+        exit(EXIT_FAILURE);
+    }
+
+    out = open(argv[1 + group], O_CREAT | O_WRONLY | O_APPEND, 0666);
 
     if (out < 0)
     {
@@ -100,7 +109,7 @@ int main(int argc, char* argv[])
 	}
 
     close(out);
-    close(in);
+    msg_queue_close(in);
     closelog();
 
     return ret;
@@ -0,0 +1,522 @@
+#include "msg_queue_lib.h"
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BACKEND_DEV "dev"
+#define BACKEND_SHM "shm"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+struct ring_slot_t
+{
+	size_t size;
+	char msg[MAX_MSG_SIZE];
+};
+
+// Shared memory queue, a zero filled one is a valid empty queue
+struct ring_t
+{
+	uint32_t lock;    // futex mutex: 0 - unlocked, 1 - locked, 2 - locked and contended
+	uint32_t pushes;  // futex word changed by every push, blocked poppers wait on it
+	uint32_t waiters; // number of blocked poppers
+	uint32_t reserved;
+	uint64_t head;    // the oldest message
+	uint64_t tail;    // the slot for the next message
+	uint64_t bytes;
+	struct ring_slot_t slots[MAX_QUEUE_SIZE];
+};
+
+struct msg_queue_t
+{
+	int fd;
+	int flags;
+	struct ring_t* ring; // NULL for the device backend
+};
+
+struct record_t
+{
+	size_t size;
+	char* msg;
+	int shared; // msg belongs to an earlier record
+};
+
+static long futex(uint32_t* addr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static void ring_lock(struct ring_t* ring)
+{
+	uint32_t c = 0;
+
+	if (__atomic_compare_exchange_n(&ring->lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+
+	if (c != 2) c = __atomic_exchange_n(&ring->lock, 2, __ATOMIC_ACQUIRE);
+	while (c != 0)
+	{
+		futex(&ring->lock, FUTEX_WAIT, 2);
+		c = __atomic_exchange_n(&ring->lock, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void ring_unlock(struct ring_t* ring)
+{
+	if (__atomic_fetch_sub(&ring->lock, 1, __ATOMIC_RELEASE) != 1)
+	{
+		__atomic_store_n(&ring->lock, 0, __ATOMIC_RELEASE);
+		futex(&ring->lock, FUTEX_WAKE, 1);
+	}
+}
+
+static void ring_wake(struct ring_t* ring)
+{
+	if (__atomic_load_n(&ring->waiters, __ATOMIC_ACQUIRE)) futex(&ring->pushes, FUTEX_WAKE, INT_MAX);
+}
+
+static ssize_t ring_push(struct msg_queue_t* queue, const struct iovec* msgs, int count)
+{
+	struct ring_t* ring = queue->ring;
+	int pushed = 0;
+
+	ring_lock(ring);
+	{
+		for (; (pushed < count) && (ring->tail - ring->head < MAX_QUEUE_SIZE); pushed++)
+		{
+			struct ring_slot_t* slot = &ring->slots[ring->tail % MAX_QUEUE_SIZE];
+			slot->size = MIN(msgs[pushed].iov_len, (size_t)MAX_MSG_SIZE);
+			memcpy(slot->msg, msgs[pushed].iov_base, slot->size);
+			ring->bytes += slot->size;
+			ring->tail++;
+		}
+		if (pushed) ring->pushes++;
+	}
+	ring_unlock(ring);
+
+	if (pushed) ring_wake(ring);
+	else if (count)
+	{
+		errno = EFULL;
+		return -1;
+	}
+	return pushed;
+}
+
+static ssize_t ring_pop(struct msg_queue_t* queue, struct iovec* msgs, int count)
+{
+	struct ring_t* ring = queue->ring;
+	int popped = 0;
+
+	while (count)
+	{
+		uint32_t pushes = 0;
+		int wait = 0;
+
+		ring_lock(ring);
+		{
+			for (; (popped < count) && (ring->head != ring->tail); popped++)
+			{
+				struct ring_slot_t* slot = &ring->slots[ring->head % MAX_QUEUE_SIZE];
+				msgs[popped].iov_len = MIN(msgs[popped].iov_len, slot->size);
+				memcpy(msgs[popped].iov_base, slot->msg, msgs[popped].iov_len);
+				ring->bytes -= slot->size;
+				ring->head++;
+			}
+			pushes = ring->pushes;
+			wait = !popped && !(queue->flags & O_NONBLOCK);
+			if (wait) __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_RELEASE);
+		}
+		ring_unlock(ring);
+
+		if (!wait) break;
+
+		wait = futex(&ring->pushes, FUTEX_WAIT, pushes);
+		__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_RELEASE);
+		if ((wait < 0) && (errno == EINTR)) break;
+	}
+
+	if (!popped && count)
+	{
+		errno = EEMPTY;
+		return -1;
+	}
+	return popped;
+}
+
+static ssize_t read_full(int fd, void* buffer, size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t ret = read(fd, (char*)buffer + done, size - done);
+		if (ret < 0) return ret;
+		if (ret == 0) break;
+		done += ret;
+	}
+	return done;
+}
+
+static ssize_t write_full(int fd, const void* buffer, size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t ret = write(fd, (const char*)buffer + done, size - done);
+		if (ret < 0) return ret;
+		done += ret;
+	}
+	return done;
+}
+
+static void records_free(struct record_t* records, size_t count)
+{
+	size_t i;
+	for (i = 0; i < count; i++) if (!records[i].shared) free(records[i].msg);
+}
+
+// Reads storage records the way the module LOAD does: up to max_count, stopping at the first malformed one
+static ssize_t records_read(int fd, struct record_t* records, size_t max_count)
+{
+	size_t count = 0;
+	size_t size = 0;
+
+	while ((count != max_count) && (read_full(fd, &size, sizeof(size)) == sizeof(size)))
+	{
+		if (size & MSG_QUEUE_BACKREF)
+		{
+			size &= ~MSG_QUEUE_BACKREF;
+			if (!size || (size > count)) break;
+			records[count] = records[count - size];
+			records[count].shared = 1;
+		}
+		else
+		{
+			if (size > MAX_MSG_SIZE) break;
+			records[count].size = size;
+			records[count].shared = 0;
+			records[count].msg = malloc(size ? size : 1);
+			if (!records[count].msg)
+			{
+				records_free(records, count);
+				errno = ENOMEM;
+				return -1;
+			}
+			if (read_full(fd, records[count].msg, size) != (ssize_t)size)
+			{
+				free(records[count].msg);
+				break;
+			}
+		}
+		count++;
+	}
+	return count;
+}
+
+static ssize_t ring_load(struct msg_queue_t* queue, const char* path)
+{
+	struct ring_t* ring = queue->ring;
+	struct record_t* records = NULL;
+	ssize_t count = 0;
+	ssize_t i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	records = malloc(MAX_QUEUE_SIZE * sizeof(struct record_t));
+	if (!records)
+	{
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	count = records_read(fd, records, MAX_QUEUE_SIZE);
+	close(fd);
+
+	if (count > 0)
+	{
+		ring_lock(ring);
+		{
+			ring->head = ring->tail = ring->bytes = 0;
+			for (i = 0; i < count; i++, ring->tail++)
+			{
+				ring->slots[i].size = records[i].size;
+				memcpy(ring->slots[i].msg, records[i].msg, records[i].size);
+				ring->bytes += records[i].size;
+			}
+			ring->pushes++;
+		}
+		ring_unlock(ring);
+		ring_wake(ring);
+		records_free(records, count);
+	}
+
+	free(records);
+	return count;
+}
+
+// Takes the messages out of the ring under the lock and writes them after it, as the module SAVE does
+static ssize_t ring_save(struct msg_queue_t* queue, const char* path)
+{
+	struct ring_t* ring = queue->ring;
+	char* records = NULL;
+	size_t size = 0;
+	ssize_t count = 0;
+	ssize_t ret = 0;
+	int fd;
+
+	fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0666);
+	if (fd < 0) return -1;
+
+	// Only the pages of the records copied are touched
+	records = malloc(sizeof(ring->slots));
+	if (!records)
+	{
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ring_lock(ring);
+	{
+		for (; ring->head != ring->tail; ring->head++, count++)
+		{
+			struct ring_slot_t* slot = &ring->slots[ring->head % MAX_QUEUE_SIZE];
+			memcpy(records + size, slot, sizeof(slot->size) + slot->size);
+			size += sizeof(slot->size) + slot->size;
+		}
+		ring->bytes = 0;
+	}
+	ring_unlock(ring);
+
+	ret = write_full(fd, records, size);
+	if (ret < 0)
+	{
+		int err = errno;
+		size_t pos = 0;
+
+		// The messages go back in front of the ring if the pushes since then left room for them
+		ring_lock(ring);
+		{
+			if (ring->tail - ring->head + count <= MAX_QUEUE_SIZE)
+			{
+				uint64_t slot_pos = ring->head - count;
+				for (; pos != size; slot_pos++)
+				{
+					struct ring_slot_t* slot = &ring->slots[slot_pos % MAX_QUEUE_SIZE];
+					memcpy(slot, records + pos, sizeof(slot->size));
+					memcpy(slot->msg, records + pos + sizeof(slot->size), slot->size);
+					ring->bytes += slot->size;
+					pos += sizeof(slot->size) + slot->size;
+				}
+				ring->head -= count;
+				ring->pushes++;
+			}
+		}
+		ring_unlock(ring);
+		ring_wake(ring);
+		errno = err;
+	}
+	else ret = count;
+
+	free(records);
+	close(fd);
+	return ret;
+}
+
+static int backend_is(const char* backend, const char* name)
+{
+	size_t len = strlen(name);
+	return !strncmp(backend, name, len) && ((backend[len] == '\0') || (backend[len] == ':'));
+}
+
+struct msg_queue_t* msg_queue_open(const char* backend, int flags)
+{
+	const char* arg = NULL;
+	struct msg_queue_t* queue = NULL;
+
+	if (!backend) backend = getenv(MSG_QUEUE_BACKEND_ENV);
+	if (!backend) backend = BACKEND_DEV;
+
+	arg = strchr(backend, ':');
+
+	queue = calloc(1, sizeof(struct msg_queue_t));
+	if (!queue) return NULL;
+
+	queue->flags = flags;
+
+	if (backend_is(backend, BACKEND_DEV))
+	{
+		queue->fd = open(arg ? arg + 1 : "/dev/"DEVICE_NAME, flags);
+		if (queue->fd < 0)
+		{
+			free(queue);
+			return NULL;
+		}
+	} else
+	if (backend_is(backend, BACKEND_SHM))
+	{
+		struct stat st;
+
+		queue->fd = shm_open(arg ? arg + 1 : "/"DEVICE_NAME, O_CREAT | O_RDWR, 0666);
+		if ((queue->fd < 0)
+			|| (fstat(queue->fd, &st) < 0)
+			|| ((st.st_size < (off_t)sizeof(struct ring_t)) && (ftruncate(queue->fd, sizeof(struct ring_t)) < 0))
+			|| ((queue->ring = mmap(NULL, sizeof(struct ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, queue->fd, 0)) == MAP_FAILED))
+		{
+			int error = errno;
+			if (queue->fd >= 0) close(queue->fd);
+			free(queue);
+			errno = error;
+			return NULL;
+		}
+	}
+	else
+	{
+		free(queue);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return queue;
+}
+
+int msg_queue_close(struct msg_queue_t* queue)
+{
+	int ret;
+
+	if (queue->ring) munmap(queue->ring, sizeof(struct ring_t));
+	ret = close(queue->fd);
+	free(queue);
+
+	return ret;
+}
+
+ssize_t msg_queue_push(struct msg_queue_t* queue, const void* msg, size_t size)
+{
+	struct iovec iov = { (void*)msg, size };
+
+	if (!queue->ring) return write(queue->fd, msg, size);
+
+	if (ring_push(queue, &iov, 1) < 0) return -1;
+	return MIN(size, (size_t)MAX_MSG_SIZE);
+}
+
+ssize_t msg_queue_pop(struct msg_queue_t* queue, void* buffer, size_t size)
+{
+	struct iovec iov = { buffer, size };
+
+	if (!queue->ring) return read(queue->fd, buffer, size);
+
+	if (ring_pop(queue, &iov, 1) < 0) return -1;
+	return iov.iov_len;
+}
+
+ssize_t msg_queue_push_batch(struct msg_queue_t* queue, const struct iovec* msgs, int count)
+{
+	ssize_t pushed = 0;
+
+	if (queue->ring) return ring_push(queue, msgs, count);
+
+	// The device pushes every iovec of a writev as a message
+	while (pushed < count)
+	{
+		int batch = MIN(count - pushed, MAX_QUEUE_SIZE);
+		ssize_t ret = writev(queue->fd, msgs + pushed, batch);
+		int i;
+
+		if (ret < 0)
+		{
+			if (pushed) break;
+			return ret;
+		}
+
+		for (i = 0; i < batch; i++)
+		{
+			size_t size = MIN(msgs[pushed].iov_len, (size_t)MAX_MSG_SIZE);
+			if ((size_t)ret < size) break;
+			ret -= size;
+			pushed++;
+		}
+		if (i != batch) break;
+	}
+	return pushed;
+}
+
+ssize_t msg_queue_pop_batch(struct msg_queue_t* queue, struct iovec* msgs, int count)
+{
+	ssize_t ret;
+	int popped = 0;
+
+	if (queue->ring) return ring_pop(queue, msgs, count);
+
+	if (count == 1)
+	{
+		ret = read(queue->fd, msgs[0].iov_base, msgs[0].iov_len);
+		if (ret < 0) return ret;
+		msgs[0].iov_len = ret;
+		return 1;
+	}
+
+	// A vectored read of the device stores a record (size and message) in every iovec
+	ret = readv(queue->fd, msgs, MIN(count, MAX_QUEUE_SIZE));
+	if (ret < 0) return ret;
+
+	for (; (popped < count) && ((size_t)ret >= sizeof(size_t)); popped++)
+	{
+		size_t size;
+		memcpy(&size, msgs[popped].iov_base, sizeof(size));
+		memmove(msgs[popped].iov_base, (char*)msgs[popped].iov_base + sizeof(size), size);
+		msgs[popped].iov_len = size;
+		ret -= sizeof(size) + size;
+	}
+	return popped;
+}
+
+ssize_t msg_queue_load(struct msg_queue_t* queue, const char* path, int async)
+{
+	if (queue->ring) return ring_load(queue, path);
+	return ioctl(queue->fd, async ? MSG_QUEUE_LOAD_ASYNC : MSG_QUEUE_LOAD, path);
+}
+
+ssize_t msg_queue_save(struct msg_queue_t* queue, const char* path, int async)
+{
+	if (queue->ring) return ring_save(queue, path);
+	return ioctl(queue->fd, async ? MSG_QUEUE_SAVE_ASYNC : MSG_QUEUE_SAVE, path);
+}
+
+int msg_queue_stat(struct msg_queue_t* queue, struct msg_queue_stat_t* stat)
+{
+	if (!queue->ring) return ioctl(queue->fd, MSG_QUEUE_STAT, stat);
+
+	memset(stat, 0, sizeof(struct msg_queue_stat_t));
+
+	ring_lock(queue->ring);
+	{
+		stat->elems = stat->blobs = queue->ring->tail - queue->ring->head;
+		stat->elem_bytes = stat->blob_bytes = queue->ring->bytes;
+	}
+	ring_unlock(queue->ring);
+
+	return 0;
+}
+
+int msg_queue_ioctl(struct msg_queue_t* queue, unsigned long cmd, void* arg)
+{
+	if (!queue->ring) return ioctl(queue->fd, cmd, arg);
+
+	errno = ENOTTY;
+	return -1;
+}
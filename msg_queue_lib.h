@@ -0,0 +1,49 @@
+#ifndef MSG_QUEUE_LIB_H
+#define MSG_QUEUE_LIB_H
+
+#include "msg_queue.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * User space access to the message queue. The backend is chosen by a string:
+ *   "dev[:path]"  - the kernel module device, /dev/msg_queue_dev by default;
+ *   "shm[:name]"  - a shared memory ring, /msg_queue_dev by default, for hosts without the module.
+ * A NULL backend is taken from the MSG_QUEUE_BACKEND environment variable, "dev" if it isn't set.
+ *
+ * All the calls return -1 and set errno on failure like the system calls do,
+ * an empty queue is reported with EEMPTY and a full one with EFULL.
+ */
+
+#define MSG_QUEUE_BACKEND_ENV "MSG_QUEUE_BACKEND"
+
+struct msg_queue_t;
+
+// flags are the open(2) access mode optionally combined with O_NONBLOCK
+struct msg_queue_t* msg_queue_open(const char* backend, int flags);
+int msg_queue_close(struct msg_queue_t* queue);
+
+ssize_t msg_queue_push(struct msg_queue_t* queue, const void* msg, size_t size);
+ssize_t msg_queue_pop(struct msg_queue_t* queue, void* buffer, size_t size);
+
+// Push every iovec as a message, return the number of messages pushed
+ssize_t msg_queue_push_batch(struct msg_queue_t* queue, const struct iovec* msgs, int count);
+// Pop up to count messages into the iovecs, their lengths are set to the message sizes.
+// The device spends a size_t of every buffer on the record header and silently truncates the message
+// to the rest, so a buffer of MSG_QUEUE_BATCH_BUFFER bytes is needed to hold any message.
+// Return the number of messages popped
+#define MSG_QUEUE_BATCH_BUFFER (MAX_MSG_SIZE + sizeof(size_t))
+ssize_t msg_queue_pop_batch(struct msg_queue_t* queue, struct iovec* msgs, int count);
+
+// Load replaces the queue with the messages from the storage file, save moves the queue to the end of it.
+// The shared memory backend runs asynchronous requests synchronously
+ssize_t msg_queue_load(struct msg_queue_t* queue, const char* path, int async);
+ssize_t msg_queue_save(struct msg_queue_t* queue, const char* path, int async);
+
+int msg_queue_stat(struct msg_queue_t* queue, struct msg_queue_stat_t* stat);
+
+// Backend specific requests, the shared memory backend supports none of them
+int msg_queue_ioctl(struct msg_queue_t* queue, unsigned long cmd, void* arg);
+
+#endif // MSG_QUEUE_LIB_H
@@ -10,6 +10,12 @@
 #include <linux/uaccess.h>
 #include <linux/spinlock.h>
 #include <linux/sched.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Petr Melnikov");
@@ -25,41 +31,89 @@ static struct device* lkm_device = NULL;
 
 static int     dev_open(struct inode*, struct file*);
 static long    dev_ioctl(struct file*, unsigned int, unsigned long);
-static ssize_t dev_read(struct file*, char*, size_t, loff_t*);
-static ssize_t dev_write(struct file*, const char*, size_t, loff_t*);
+static ssize_t dev_read_iter(struct kiocb*, struct iov_iter*);
+static ssize_t dev_write_iter(struct kiocb*, struct iov_iter*);
+static __poll_t dev_poll(struct file*, poll_table*);
 static int     dev_release(struct inode*, struct file*);
 
 static struct file_operations dev_oper =
 {
 	.open           = dev_open,
 	.unlocked_ioctl = dev_ioctl,
-    .read           = dev_read,
-    .write          = dev_write,
+    .read_iter      = dev_read_iter,
+    .write_iter     = dev_write_iter,
+    .poll           = dev_poll,
     .release        = dev_release,
 };
 
 struct queue_elem_t;
+struct queue_tenant_t;
 
-static struct queue_elem_t* queue_crt(void);
+static struct queue_elem_t* queue_crt(gfp_t flags, size_t size);
 static void queue_del(struct queue_elem_t* queue_elem);
+static void queue_share(struct queue_elem_t* queue_elem);
+static void queue_stat(struct msg_queue_stat_t* stat);
+static void queue_consumed(struct queue_elem_t* queue_elem);
 
 static char* queue_msg(struct queue_elem_t* queue_elem);
 static size_t queue_msg_size(struct queue_elem_t* queue_elem);
 static void queue_set_msg_size(struct queue_elem_t* queue_elem, size_t size);
+static void queue_set_tenant(struct queue_elem_t* queue_elem, struct queue_tenant_t* tenant);
 static struct queue_elem_t* queue_prev(struct queue_elem_t* queue_elem);
+static struct queue_elem_t* queue_prev_rcu(struct queue_elem_t* queue_elem);
+static struct queue_elem_t* queue_next(struct queue_elem_t* queue_elem);
+static u64 queue_seq(struct queue_elem_t* queue_elem);
+static void queue_number(struct queue_elem_t* pos, u64* seq);
+static struct queue_elem_t* queue_link(struct queue_elem_t* queue_elem, struct queue_elem_t* list);
+static void queue_del_list(struct queue_elem_t* pos);
+static int queue_msg_match(struct queue_elem_t* queue_elem, const struct msg_queue_filter_t* filter);
 
 static void queue_ins(struct queue_elem_t* queue_elem, struct queue_elem_t* before_this);
 static void queue_rmv(struct queue_elem_t* queue_elem);
 static void queue_del_all(struct queue_elem_t* queue_elem);
 
-static ssize_t queue_read_msg(struct file* fp, ssize_t (*read)(struct file*, char*, size_t, loff_t*), struct queue_elem_t* queue_elem);
+static ssize_t queue_read_msg(struct file* fp, ssize_t (*read)(struct file*, char*, size_t, loff_t*), struct queue_elem_t* recent, struct queue_elem_t** queue_elem);
 static ssize_t queue_write_msg(struct file* fp, ssize_t (*write)(struct file*, const char*, size_t, loff_t*), struct queue_elem_t* queue_elem);
 
 static ssize_t queue_read(struct file* fp, ssize_t (*read)(struct file*, char*, size_t, loff_t*), size_t max_size, struct queue_elem_t** first, struct queue_elem_t** last);
-static ssize_t queue_write(struct file* fp, ssize_t (*write)(struct file*, const char*, size_t, loff_t*), struct queue_elem_t* pos);
+static ssize_t queue_write(struct file* fp, ssize_t (*write)(struct file*, const char*, size_t, loff_t*), struct queue_elem_t* pos, size_t count);
+
+static struct queue_tenant_t* queue_tenant_get(void);
+static int queue_tenant_acquire(struct queue_tenant_t* tenant, size_t size, int nonblock);
+static void queue_tenant_release(struct queue_tenant_t* tenant, size_t msgs, size_t size);
+static void queue_tenant_stat(struct msg_queue_tenants_t* tenants);
+static void queue_tenant_del_all(void);
+
+static void queue_spill_fill(void);
+static void queue_spill_wait(void);
+static ssize_t queue_spill_save(struct file* fp, ssize_t (*write)(struct file*, const char*, size_t, loff_t*), size_t count);
+static void queue_spill_reset(void);
+static void queue_spill_init(void);
+static void queue_spill_exit(void);
+
+struct queue_part_t;
+struct queue_member_t;
+
+static struct queue_part_t* queue_part_get(const void* key, size_t size);
+static int queue_part_writable(struct queue_part_t* part);
+static int queue_part_push(struct queue_part_t* part, struct queue_elem_t* first, size_t* new_size);
+static struct queue_elem_t* queue_part_pop(struct queue_member_t* member, size_t* new_size);
+static int queue_part_ready(struct queue_member_t* member);
+static wait_queue_head_t* queue_member_waits(struct queue_member_t* member);
+static struct queue_member_t* queue_group_join(void);
+static void queue_group_leave(struct queue_member_t* member);
+static void queue_part_init(void);
+static void queue_part_del_all(void);
+
+#define FILTER_SCAN_BYTES MAX_MSG_SIZE // message bytes a read filter checks per queue_lock hold
+
+#define SPILL_KEEP       64  // the newest elements never spilled
+#define SPILL_FILL_LOW   64  // read the spill file back when fewer elements are ahead
+#define SPILL_FILL_BATCH 256 // records read back at once
 
 static struct file* file_open(const char* path, int flags, int rights);
 static void file_close(struct file* fp);
+static int file_unlink(const char* path);
 static ssize_t file_read(struct file* fp, char* buffer, size_t len, loff_t* off);
 static ssize_t file_write(struct file* fp, const char* buffer, size_t len, loff_t* off);
 
@@ -68,6 +122,12 @@ struct queue_t
 	struct queue_elem_t* first;
 	struct queue_elem_t* last;
 	size_t size;
+	size_t ahead;    // the oldest elements read back from the spill file
+	size_t spilled;  // messages in the spill file, they go after the ahead elements
+	unsigned long gen;
+	u64 seq;         // the last browse cursor given to an element
+	u64 last_push;   // local_clock() of the last push
+	u64 arrival_avg; // moving average of the time between pushes
 };
 
 static struct queue_t queue =
@@ -75,10 +135,33 @@ static struct queue_t queue =
 	.first = NULL,
 	.last = NULL,
 	.size = 0,
+	.ahead = 0,
+	.spilled = 0,
+	.gen = 0,
+	.seq = 0,
+	.last_push = 0,
+	.arrival_avg = 0,
+};
+
+// Outside of struct queue_t, which SAVE copies and restores
+static atomic_long_t queue_busy_polls = ATOMIC_LONG_INIT(0);
+static atomic_long_t queue_busy_poll_hits = ATOMIC_LONG_INIT(0);
+
+struct dev_file_t
+{
+	struct msg_queue_filter_t* filter;
+	unsigned long seen; // the queue generation the filter has been checked against
+	u64 resume;         // the newest message checked not to match the filter
+	unsigned int busy_poll; // busy poll budget, us
+	struct queue_part_t* part;     // the partition written to, NULL - the shared queue
+	struct queue_member_t* member; // set when the descriptor has joined the consumer group
 };
 
 static spinlock_t queue_lock = __SPIN_LOCK_UNLOCKED();
 
+// Serializes the spill file users: the spill and fill works, LOAD and SAVE
+static DEFINE_MUTEX(queue_spill_lock);
+
 static struct workqueue_struct* queue_works = NULL;
 
 static wait_queue_head_t queue_waits;
@@ -92,6 +175,185 @@ struct queue_work_data_t
 
 static long queue_cmd(struct work_struct* work_data);
 
+static void queue_unlink(struct queue_elem_t* queue_elem)
+{
+	if (queue.last == queue_elem) WRITE_ONCE(queue.last, queue_prev(queue_elem));
+	if (queue.first == queue_elem) WRITE_ONCE(queue.first, queue_next(queue_elem));
+	queue_rmv(queue_elem);
+	--queue.size;
+}
+
+/*
+ * While messages are spilled only the ahead elements may be taken, the newer ones wait
+ * until the spill file is read back.
+ */
+static struct queue_elem_t* queue_pop(struct dev_file_t* dev_file, size_t* new_size)
+{
+	struct queue_elem_t* last = NULL;
+	struct queue_elem_t* dropped = NULL;
+	size_t old_size = 0;
+	int fill = 0;
+
+	if (dev_file->member) return queue_part_pop(dev_file->member, new_size);
+
+	spin_lock(&queue_lock);
+	{
+		size_t avail = queue.spilled ? queue.ahead : queue.size;
+
+		old_size = queue.size;
+		if (!dev_file->filter)
+		{
+			if (avail > 0)
+			{
+				last = queue.last;
+				queue_unlink(last);
+				if (queue.ahead) queue.ahead--;
+			}
+		}
+		else
+		{
+			struct queue_elem_t* pos = queue.last;
+			size_t ahead = queue.ahead;
+			size_t budget = FILTER_SCAN_BYTES;
+
+			// The messages up to the resume one have already been found not to match
+			if (dev_file->resume)
+			{
+				struct queue_elem_t* at = pos;
+				size_t skip = 1;
+
+				for (; at && (skip <= avail) && (queue_seq(at) != dev_file->resume); skip++) at = queue_prev(at);
+				if (at && (skip <= avail))
+				{
+					pos = queue_prev(at);
+					avail -= skip;
+					ahead = (ahead > skip) ? ahead - skip : 0;
+				}
+			}
+
+			for (; pos && !last && avail && budget; avail--)
+			{
+				struct queue_elem_t* tmp = pos;
+				int is_ahead = ahead > 0;
+
+				pos = queue_prev(pos);
+				if (ahead) ahead--;
+				budget -= min(budget, queue_msg_size(tmp) + 1);
+
+				if (queue_msg_match(tmp, dev_file->filter))
+				{
+					last = tmp;
+					if (is_ahead) queue.ahead--;
+				} else
+				if (dev_file->filter->flags & MSG_QUEUE_FILTER_DROP)
+				{
+					queue_unlink(tmp);
+					if (is_ahead) queue.ahead--;
+					dropped = queue_link(tmp, dropped);
+				}
+				else dev_file->resume = queue_seq(tmp);
+			}
+
+			// Out of the budget the reader comes back for the rest without waiting
+			if (last) queue_unlink(last);
+			else if (!pos || !avail) dev_file->seen = queue.gen;
+		}
+		*new_size = queue.size;
+		fill = queue.spilled && (queue.ahead < SPILL_FILL_LOW);
+	}
+	spin_unlock(&queue_lock);
+
+	queue_del_list(dropped);
+
+	if (fill) queue_spill_fill();
+	if ((old_size == MAX_QUEUE_SIZE) && (*new_size < MAX_QUEUE_SIZE)) wake_up_interruptible(&queue_waits);
+	return last;
+}
+
+// Messages a reader may take now
+static size_t queue_avail(void)
+{
+	if (READ_ONCE(queue.spilled)) return READ_ONCE(queue.ahead);
+	return READ_ONCE(queue.size);
+}
+
+static wait_queue_head_t* queue_waits_of(struct dev_file_t* dev_file)
+{
+	if (dev_file->member) return queue_member_waits(dev_file->member);
+	return &queue_waits;
+}
+
+static int queue_ready(struct dev_file_t* dev_file)
+{
+	if (dev_file->member) return queue_part_ready(dev_file->member);
+	if (!queue_avail())
+	{
+		if (READ_ONCE(queue.spilled)) queue_spill_fill();
+		return 0;
+	}
+	return !READ_ONCE(dev_file->filter) || (READ_ONCE(queue.gen) != dev_file->seen);
+}
+
+/*
+ * Spins until a message the reader can take arrives. The spin is limited by the budget of the descriptor
+ * and by twice the average arrival interval, and it is skipped when messages arrive less often than the budget.
+ */
+static int queue_spin(struct dev_file_t* dev_file)
+{
+	u64 budget = (u64)READ_ONCE(dev_file->busy_poll) * NSEC_PER_USEC;
+	u64 avg = READ_ONCE(queue.arrival_avg);
+	u64 end = 0;
+
+	if (!budget || (avg > budget)) return 0;
+
+	atomic_long_inc(&queue_busy_polls);
+	end = local_clock() + (avg ? min(budget, 2 * avg) : budget);
+	while (!queue_ready(dev_file))
+	{
+		if ((local_clock() >= end) || need_resched() || signal_pending(current)) return 0;
+		cpu_relax();
+	}
+	atomic_long_inc(&queue_busy_poll_hits);
+	return 1;
+}
+
+static int queue_push(struct queue_elem_t* first, size_t* new_size)
+{
+	int pushed = 0;
+	u64 now = local_clock();
+
+	spin_lock(&queue_lock);
+	{
+		if (queue.size < MAX_QUEUE_SIZE)
+		{
+			if (queue.last_push && (now > queue.last_push))
+			{
+				u64 interval = min(now - queue.last_push, (u64)NSEC_PER_SEC);
+				queue.arrival_avg = queue.arrival_avg - (queue.arrival_avg >> 3) + (interval >> 3);
+			}
+			queue.last_push = now;
+
+			queue_number(first, &queue.seq);
+			if (queue.first != NULL)
+			{
+				queue_ins(first, queue.first);
+			}
+			else
+			{
+				rcu_assign_pointer(queue.last, first);
+			}
+			rcu_assign_pointer(queue.first, first);
+			*new_size = ++queue.size;
+			queue.gen++;
+			pushed = 1;
+		}
+	}
+	spin_unlock(&queue_lock);
+
+	if (pushed) wake_up_interruptible(&queue_waits);
+	return pushed;
+}
+
 static void queue_work_fn(struct work_struct* work_data)
 {
 	queue_cmd(work_data);
@@ -130,14 +392,24 @@ static long queue_cmd(struct work_struct* work_data)
 			if (ret > 0)
 			{
 				struct queue_elem_t* old_first = NULL;
+				size_t spilled = 0;
+
+				mutex_lock(&queue_spill_lock);
 				spin_lock(&queue_lock);
 				{
 					old_first = queue.first;
-					queue.first = first;
-					queue.last = last;
+					spilled = queue.spilled;
+					queue_number(last, &queue.seq);
+					rcu_assign_pointer(queue.first, first);
+					rcu_assign_pointer(queue.last, last);
 					queue.size = ret;
+					queue.ahead = 0;
+					queue.spilled = 0;
+					queue.gen++;
 				}
 				spin_unlock(&queue_lock);
+				if (spilled) queue_spill_reset();
+				mutex_unlock(&queue_spill_lock);
 				queue_del_all(old_first);
 			}
 			printk(KERN_INFO "msg_queue_lkm: %zd messages have been read from the file\n", ret);
@@ -162,16 +434,37 @@ static long queue_cmd(struct work_struct* work_data)
 
 		kfree(path);
 
+		mutex_lock(&queue_spill_lock);
 		spin_lock(&queue_lock);
 		{
 			old_queue = queue;
-			queue.first = NULL;
-			queue.last = NULL;
+			RCU_INIT_POINTER(queue.first, NULL);
+			RCU_INIT_POINTER(queue.last, NULL);
 			queue.size = 0;
+			queue.ahead = 0;
+			queue.spilled = 0;
 		}
 		spin_unlock(&queue_lock);
 
-		ret = queue_write(out_fp, file_write, old_queue.last);
+		// The ahead elements, the spilled ones and then the rest
+		ret = queue_write(out_fp, file_write, old_queue.last, old_queue.ahead);
+		if ((ret >= 0) && old_queue.spilled)
+		{
+			ssize_t spilled = queue_spill_save(out_fp, file_write, old_queue.spilled);
+			ret = (spilled < 0) ? spilled : ret + spilled;
+		}
+		if (ret >= 0)
+		{
+			struct queue_elem_t* pos = old_queue.last;
+			ssize_t rest = 0;
+			size_t ahead = old_queue.ahead;
+
+			for (; pos && ahead; ahead--) pos = queue_prev(pos);
+			rest = queue_write(out_fp, file_write, pos, SIZE_MAX);
+			ret = (rest < 0) ? rest : ret + rest;
+		}
+
+		if ((ret >= 0) && old_queue.spilled) queue_spill_reset();
 
 		if (ret < 0)
 		{
@@ -182,7 +475,9 @@ static long queue_cmd(struct work_struct* work_data)
 			spin_unlock(&queue_lock);
 			printk(KERN_ALERT "msg_queue_lkm: failed to write message queue to the file\n");
 		}
-		else
+		mutex_unlock(&queue_spill_lock);
+
+		if (ret >= 0)
 		{
 			queue_del_all(old_queue.first);
 			printk(KERN_INFO "msg_queue_lkm: %zd message(s) have been written to the file\n", ret);
@@ -241,6 +536,9 @@ static int /*__init*/ lkm_init(void)
 
     init_waitqueue_head(&queue_waits);
 
+	queue_spill_init();
+	queue_part_init();
+
 	return 0;
 }
 
@@ -248,6 +546,8 @@ static void /*__exit*/ lkm_exit(void)
 {
 	struct queue_elem_t* first = NULL;
 
+	queue_spill_exit();
+
 	spin_lock(&queue_lock);
 	{
 		first = queue.first;
@@ -258,6 +558,8 @@ static void /*__exit*/ lkm_exit(void)
 	spin_unlock(&queue_lock);
 
 	queue_del_all(first);
+	queue_part_del_all();
+	queue_tenant_del_all();
 
 	device_destroy(lkm_class, MKDEV(lkm_major_number, 0));
 	class_unregister(lkm_class);
@@ -269,15 +571,182 @@ static void /*__exit*/ lkm_exit(void)
 
 static int dev_open(struct inode* ndp, struct file* fp)
 {
+	fp->private_data = kzalloc(sizeof(struct dev_file_t), GFP_KERNEL);
+	if (!fp->private_data) return -ENOMEM;
+
+	fp->f_mode |= FMODE_NOWAIT;
 	printk(KERN_INFO "msg_queue_lkm: device has been opened\n");
 	return 0;
 }
 
+static long dev_set_filter(struct dev_file_t* dev_file, const struct msg_queue_filter_t __user* args)
+{
+	struct msg_queue_filter_t* filter = kmalloc(sizeof(struct msg_queue_filter_t), GFP_KERNEL);
+	if (!filter) return -ENOMEM;
+
+	if (copy_from_user(filter, args, sizeof(struct msg_queue_filter_t)))
+	{
+		kfree(filter);
+		return -EFAULT;
+	}
+
+	if ((filter->size > MAX_FILTER_SIZE) || (filter->offset > MAX_MSG_SIZE))
+	{
+		kfree(filter);
+		return -EINVAL;
+	}
+
+	if (!filter->size)
+	{
+		kfree(filter);
+		filter = NULL;
+	}
+
+	spin_lock(&queue_lock);
+	{
+		swap(dev_file->filter, filter);
+		dev_file->seen = queue.gen - 1;
+		dev_file->resume = 0;
+	}
+	spin_unlock(&queue_lock);
+
+	kfree(filter);
+	wake_up_interruptible(&queue_waits);
+
+	printk(KERN_INFO "msg_queue_lkm: the read filter has been %s\n", dev_file->filter ? "attached" : "detached");
+	return 0;
+}
+
+static long dev_stat(struct msg_queue_stat_t __user* args)
+{
+	struct msg_queue_stat_t stat = {0};
+
+	queue_stat(&stat);
+	stat.spilled = READ_ONCE(queue.spilled);
+	stat.busy_polls = atomic_long_read(&queue_busy_polls);
+	stat.busy_poll_hits = atomic_long_read(&queue_busy_poll_hits);
+	if (copy_to_user(args, &stat, sizeof(stat))) return -EFAULT;
+	return 0;
+}
+
+static long dev_tenants(struct msg_queue_tenants_t __user* args)
+{
+	long ret = 0;
+	struct msg_queue_tenants_t* tenants = kzalloc(sizeof(struct msg_queue_tenants_t), GFP_KERNEL);
+	if (!tenants) return -ENOMEM;
+
+	queue_tenant_stat(tenants);
+	if (copy_to_user(args, tenants, sizeof(struct msg_queue_tenants_t))) ret = -EFAULT;
+
+	kfree(tenants);
+	return ret;
+}
+
+/*
+ * Copies the oldest, the newest or the next browsed message. The queue is walked under RCU only,
+ * so monitoring never holds queue_lock against the producers and the consumers.
+ */
+static long dev_peek(unsigned int cmd, struct msg_queue_peek_t __user* args)
+{
+	long ret = 0;
+	size_t msg_size = 0;
+	struct msg_queue_peek_t peek = {0};
+	struct queue_elem_t* pos = NULL;
+	char* buffer = NULL;
+
+	if (copy_from_user(&peek, args, sizeof(peek))) return -EFAULT;
+
+	buffer = kmalloc(min_t(size_t, peek.size, MAX_MSG_SIZE), GFP_KERNEL);
+	if (!buffer && peek.size) return -ENOMEM;
+
+	rcu_read_lock();
+	{
+		pos = rcu_dereference(queue.last);
+		if ((cmd == MSG_QUEUE_PEEK) && (peek.flags & MSG_QUEUE_PEEK_NEWEST)) pos = rcu_dereference(queue.first); else
+		if ((cmd == MSG_QUEUE_BROWSE) && peek.cursor)
+		{
+			struct queue_elem_t* at = pos;
+			for (; at && (queue_seq(at) != peek.cursor); at = queue_prev_rcu(at));
+			if (at) pos = queue_prev_rcu(at);
+		}
+
+		if (pos)
+		{
+			msg_size = queue_msg_size(pos);
+			memcpy(buffer, queue_msg(pos), min_t(size_t, msg_size, min_t(size_t, peek.size, MAX_MSG_SIZE)));
+			peek.cursor = queue_seq(pos);
+		}
+	}
+	rcu_read_unlock();
+
+	if (!pos) ret = -EEMPTY;
+	else
+	{
+		if (copy_to_user(peek.buffer, buffer, min_t(size_t, msg_size, min_t(size_t, peek.size, MAX_MSG_SIZE)))) ret = -EFAULT;
+		peek.size = msg_size;
+		if (!ret && copy_to_user(args, &peek, sizeof(peek))) ret = -EFAULT;
+	}
+
+	kfree(buffer);
+	return ret;
+}
+
+static long dev_set_key(struct dev_file_t* dev_file, const struct msg_queue_key_t __user* args)
+{
+	struct msg_queue_key_t* key = kmalloc(sizeof(struct msg_queue_key_t), GFP_KERNEL);
+	if (!key) return -ENOMEM;
+
+	if (copy_from_user(key, args, sizeof(struct msg_queue_key_t)))
+	{
+		kfree(key);
+		return -EFAULT;
+	}
+
+	if (key->size > MAX_KEY_SIZE)
+	{
+		kfree(key);
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(dev_file->part, key->size ? queue_part_get(key->key, key->size) : NULL);
+
+	kfree(key);
+	return 0;
+}
+
+static long dev_join(struct dev_file_t* dev_file)
+{
+	struct queue_member_t* member = NULL;
+
+	if (READ_ONCE(dev_file->member)) return 0;
+
+	member = queue_group_join();
+	if (!member) return -ENOMEM;
+
+	if (cmpxchg(&dev_file->member, NULL, member) != NULL) queue_group_leave(member);
+
+	// The readers of the descriptor waiting for the shared queue switch to the partitions
+	wake_up_interruptible(&queue_waits);
+
+	printk(KERN_INFO "msg_queue_lkm: the descriptor has joined the consumer group\n");
+	return 0;
+}
+
 static long dev_ioctl(struct file* fp, unsigned int cmd, unsigned long args)
 {
-	size_t path_len = strnlen_user((const char __user*)args, PATH_MAX);
+	size_t path_len = 0;
 	struct queue_work_data_t* queue_work_data = NULL;
 
+	if (cmd == MSG_QUEUE_SET_FILTER) return dev_set_filter(fp->private_data, (const struct msg_queue_filter_t __user*)args);
+	if (cmd == MSG_QUEUE_STAT) return dev_stat((struct msg_queue_stat_t __user*)args);
+	if (cmd == MSG_QUEUE_TENANTS) return dev_tenants((struct msg_queue_tenants_t __user*)args);
+	if (cmd == MSG_QUEUE_SET_KEY) return dev_set_key(fp->private_data, (const struct msg_queue_key_t __user*)args);
+	if (cmd == MSG_QUEUE_JOIN) return dev_join(fp->private_data);
+	if ((cmd == MSG_QUEUE_PEEK) || (cmd == MSG_QUEUE_BROWSE)) return dev_peek(cmd, (struct msg_queue_peek_t __user*)args);
+	if (cmd == MSG_QUEUE_SET_BUSY_POLL) return get_user(((struct dev_file_t*)fp->private_data)->busy_poll, (unsigned int __user*)args);
+
+	path_len = strnlen_user((const char __user*)args, PATH_MAX);
+
 	queue_work_data = kmalloc(sizeof(struct queue_work_data_t), GFP_KERNEL);
 	if (!queue_work_data) return -ENOMEM;
 
@@ -307,105 +776,178 @@ static long dev_ioctl(struct file* fp, unsigned int cmd, unsigned long args)
 	return 0;
 }
 
-static ssize_t dev_read(struct file* fp, char* buffer, size_t len, loff_t* off)
+/*
+ * Only a user iovec array of several segments (readv, preadv2) is read as records, see msg_queue.h:
+ * one message per iovec stored as a storage record (size followed by the message) so the consumer can tell
+ * the messages apart. Anything else, a registered io_uring buffer (a bvec per page) included, is one flat buffer
+ * for one message. IOCB_NOWAIT requests (io_uring) get -EAGAIN instead of sleeping on the empty queue.
+ * A queue with spilled messages is not empty: O_NONBLOCK readers get -EAGAIN rather than -EEMPTY for it.
+ */
+static ssize_t dev_read_iter(struct kiocb* iocb, struct iov_iter* to)
 {
-	size_t queue_new_size = 0;
-    struct queue_elem_t* last = NULL;
+    struct file* fp = iocb->ki_filp;
+    int records = iter_is_iovec(to) && (to->nr_segs > 1);
+    int refilled = 0;
+    size_t queue_new_size = 0;
+    ssize_t read = 0;
 
-    do
+    while (iov_iter_count(to))
     {
-        spin_lock(&queue_lock);
+        size_t seg_size = records ? iov_iter_single_seg_count(to) : iov_iter_count(to);
+        size_t hdr_size = records ? sizeof(size_t) : 0;
+        struct queue_elem_t* last = NULL;
+        wait_queue_head_t* waits = NULL;
+
+        if (seg_size < hdr_size)
         {
-            if (queue.size > 0)
-            {
-                last = queue.last;
-                queue.last = queue_prev(queue.last);
-                if (!queue.last) queue.first = NULL;
-                queue_rmv(last);
-                queue_new_size = --queue.size;
-            }
+            if (!read) return -EINVAL;
+            break;
         }
-        spin_unlock(&queue_lock);
+
+        last = queue_pop(fp->private_data, &queue_new_size);
+        queue_consumed(last);
 
         if (last != NULL)
         {
-            size_t msg_size = min(len, queue_msg_size(last));
-            size_t error_count = copy_to_user(buffer, queue_msg(last), msg_size);
+            size_t msg_size = min(seg_size - hdr_size, queue_msg_size(last));
+            size_t copied = hdr_size ? copy_to_iter(&msg_size, hdr_size, to) : 0;
+
+            if (copied == hdr_size) copied += copy_to_iter(queue_msg(last), msg_size, to);
+            queue_del(last);
 
-            if (error_count != 0)
+            printk(KERN_INFO "msg_queue_lkm: the queue size was decremented (new size = %zu)\n", queue_new_size);
+
+            read += copied;
+            if (copied != hdr_size + msg_size)
             {
-                printk(KERN_ALERT "msg_queue_lkm: failed to send %zu characters to the user\n", error_count);
+                printk(KERN_ALERT "msg_queue_lkm: failed to send %zu characters to the user\n", hdr_size + msg_size - copied);
+                break;
             }
+            if (!records) break;
+            iov_iter_advance(to, seg_size - copied);
+        }
+        else
+        {
+            struct dev_file_t* dev_file = fp->private_data;
+            int spilled = !dev_file->member && READ_ONCE(queue.spilled);
 
-            msg_size -= error_count;
-
-            printk(KERN_INFO "msg_queue_lkm: the queue size was decremented (new size = %zu)\n", queue_new_size);
-            return msg_size;
+            if (read) break;
+            if (fp->f_flags & O_NONBLOCK)
+            {
+                // The spilled messages don't make the queue empty, the reader waits for them to be read back once
+                if (!spilled) break;
+                if (refilled++ || (iocb->ki_flags & IOCB_NOWAIT)) return -EAGAIN;
+                queue_spill_wait();
+                continue;
+            }
+            if (iocb->ki_flags & IOCB_NOWAIT) return -EAGAIN;
+            if (queue_spin(fp->private_data)) continue;
+            waits = queue_waits_of(fp->private_data);
+            if (wait_event_interruptible(*waits, queue_ready(fp->private_data))) break;
         }
     }
-    while(!(fp->f_flags & O_NONBLOCK) && !wait_event_interruptible(queue_waits, queue.size));
 
-    printk(KERN_INFO "msg_queue_lkm: the queue is empty\n");
-    return -EEMPTY;
+    if (!read)
+    {
+        printk(KERN_INFO "msg_queue_lkm: the queue is empty\n");
+        return -EEMPTY;
+    }
+    return read;
 }
 
-static ssize_t dev_write(struct file* fp, const char* buffer, size_t len, loff_t* off)
+/*
+ * Every iovec of a user iovec array of several segments (writev, pwritev2) is pushed as a separate message,
+ * any other write, a registered io_uring buffer included, pushes one.
+ * Writes never wait for free space, so IOCB_NOWAIT only affects the memory allocation.
+ */
+static ssize_t dev_write_iter(struct kiocb* iocb, struct iov_iter* from)
 {
+    struct dev_file_t* dev_file = iocb->ki_filp->private_data;
     size_t queue_new_size = 0;
-    struct queue_elem_t* first = queue_crt();
-	if (first)
-	{
-		size_t msg_size = min(len, (size_t)MAX_MSG_SIZE);
-        size_t error_count = copy_from_user(queue_msg(first), buffer, msg_size);
+    ssize_t written = 0;
+    int nonblock = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+    int records = iter_is_iovec(from) && (from->nr_segs > 1);
+    struct queue_tenant_t* tenant = queue_tenant_get();
+
+    if (!tenant) return -ENOMEM;
+
+    do
+    {
+        size_t seg_size = records ? iov_iter_single_seg_count(from) : iov_iter_count(from);
+        size_t msg_size = min(seg_size, (size_t)MAX_MSG_SIZE);
+        size_t copied = 0;
+        struct queue_elem_t* first = NULL;
+        int ret = queue_tenant_acquire(tenant, msg_size, nonblock);
 
-        if (error_count != 0)
+        if (ret)
         {
-           printk(KERN_ALERT "msg_queue_lkm: failed to send %zu characters from the user\n", error_count);
+            printk(KERN_ALERT "msg_queue_lkm: the producer [uid = %u] is over its %s\n",
+                from_kuid_munged(current_user_ns(), current_fsuid()), (ret == -EDQUOT) ? "quota" : "push rate");
+            if (!written) return ret;
+            break;
         }
 
-        msg_size -= error_count;
-        queue_set_msg_size(first, msg_size);
+        first = queue_crt((iocb->ki_flags & IOCB_NOWAIT) ? GFP_NOWAIT : GFP_KERNEL, msg_size);
 
-        spin_lock(&queue_lock);
-		{
-            if (queue.size < MAX_QUEUE_SIZE)
-            {
-                if (queue.first != NULL)
-                {
-                    queue_ins(first, queue.first);
-                }
-                else
-                {
-                    queue.last = first;
-                }
-                queue.first = first;
-                queue_new_size = ++queue.size;
-            }
-		}
-		spin_unlock(&queue_lock);
+        if (!first)
+        {
+            queue_tenant_release(tenant, 1, msg_size);
+            printk(KERN_ALERT "msg_queue_lkm: failed to allocate memory for a new queue element\n");
+            if (!written) return (iocb->ki_flags & IOCB_NOWAIT) ? -EAGAIN : -ENOMEM;
+            break;
+        }
 
-        if (!queue_new_size)
+        queue_set_tenant(first, tenant);
+
+        copied = copy_from_iter(queue_msg(first), msg_size, from);
+        if (copied != msg_size)
         {
-            queue_del(first);
-			printk(KERN_ALERT "msg_queue_lkm: failed to push message, the queue is full [size = %zu]\n", (size_t)MAX_QUEUE_SIZE);
-            return -EFULL;
+            printk(KERN_ALERT "msg_queue_lkm: failed to send %zu characters from the user\n", msg_size - copied);
         }
-        else
+
+        queue_tenant_release(tenant, 0, msg_size - copied);
+        queue_set_msg_size(first, copied);
+        queue_share(first);
+
+        if (!(dev_file->part ? queue_part_push(dev_file->part, first, &queue_new_size) : queue_push(first, &queue_new_size)))
         {
-            wake_up_interruptible(&queue_waits);
-            printk(KERN_INFO "msg_queue_lkm: the queue size was incremented [size = %zu]\n", queue_new_size);
-            return msg_size;
+            queue_del(first);
+            printk(KERN_ALERT "msg_queue_lkm: failed to push message, the queue is full [size = %zu]\n", (size_t)MAX_QUEUE_SIZE);
+            if (!written) return -EFULL;
+            break;
         }
-	}
-    else
-    {
-        printk(KERN_ALERT "msg_queue_lkm: failed to allocate memory for a new queue element\n");
-        return -ENOMEM;
+
+        printk(KERN_INFO "msg_queue_lkm: the queue size was incremented [size = %zu]\n", queue_new_size);
+
+        written += copied;
+        if (copied != msg_size) break;
+        iov_iter_advance(from, seg_size - copied);
     }
+    while (iov_iter_count(from));
+
+    return written;
+}
+
+static __poll_t dev_poll(struct file* fp, poll_table* wait)
+{
+    struct dev_file_t* dev_file = fp->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(fp, queue_waits_of(fp->private_data), wait);
+
+    if (queue_ready(fp->private_data)) mask |= EPOLLIN | EPOLLRDNORM;
+    if (dev_file->part ? queue_part_writable(dev_file->part) : (READ_ONCE(queue.size) < MAX_QUEUE_SIZE)) mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
 }
 
 static int dev_release(struct inode* ndp, struct file* fp)
 {
+   struct dev_file_t* dev_file = fp->private_data;
+
+   if (dev_file->member) queue_group_leave(dev_file->member);
+   kfree(dev_file->filter);
+   kfree(dev_file);
    printk(KERN_INFO "msg_queue_lkm: device successfully closed\n");
    return 0;
 }
@@ -415,3 +957,6 @@ module_exit(lkm_exit)
 
 #include "msg_queue_lkm_fops.c"
 #include "msg_queue_lkm_qops.c"
+#include "msg_queue_lkm_tops.c"
+#include "msg_queue_lkm_sops.c"
+#include "msg_queue_lkm_pops.c"
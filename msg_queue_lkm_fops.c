@@ -1,4 +1,5 @@
 #include <linux/fs.h>
+#include <linux/namei.h>
 #include <linux/uaccess.h>
 #include <linux/buffer_head.h>
 
@@ -20,6 +21,30 @@ static void file_close(struct file* fp)
     filp_close(fp, NULL);
 }
 
+// Removes the last component of the path, a symlink itself rather than its target
+static int file_unlink(const char* path)
+{
+    struct path file_path;
+    struct dentry* parent;
+    int err;
+
+    err = kern_path(path, 0, &file_path);
+    if (err) return err;
+
+    parent = dget_parent(file_path.dentry);
+    inode_lock_nested(d_inode(parent), I_MUTEX_PARENT);
+
+    // The file may have been renamed since the lookup
+    if (file_path.dentry->d_parent == parent) err = vfs_unlink(d_inode(parent), file_path.dentry, NULL);
+    else err = -EAGAIN;
+
+    inode_unlock(d_inode(parent));
+    dput(parent);
+    path_put(&file_path);
+
+    return err;
+}
+
 static ssize_t file_read(struct file* fp, char* buffer, size_t len, loff_t* off)
 {
     mm_segment_t oldfs;
@@ -0,0 +1,262 @@
+#include "msg_queue.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/xxhash.h>
+#include <linux/moduleparam.h>
+
+/*
+ * Keyed messages go to one of the partitions chosen by the hash of the key. Every partition
+ * is a FIFO of its own owned by one member of the consumer group, so the members drain
+ * the partitions in parallel and the messages of a key are read in order.
+ */
+
+struct queue_member_t
+{
+	struct list_head node;
+	wait_queue_head_t waits;
+	size_t quota; // partitions the member should own
+	size_t owned;
+	size_t next;  // the partition to read first
+};
+
+struct queue_part_t
+{
+	spinlock_t lock;
+	struct queue_elem_t* first;
+	struct queue_elem_t* last;
+	size_t size;
+	struct queue_member_t* owner; // changed under both queue_group_lock and the partition lock
+} ____cacheline_aligned_in_smp;
+
+static unsigned int partitions = 8;
+module_param(partitions, uint, 0444);
+MODULE_PARM_DESC(partitions, "Partitions of the keyed messages, 1 to " __stringify(MSG_QUEUE_MAX_PARTITIONS));
+
+static struct queue_part_t queue_parts[MSG_QUEUE_MAX_PARTITIONS];
+
+static LIST_HEAD(queue_members);
+static DEFINE_MUTEX(queue_group_lock);
+
+/*
+ * The partitions share MAX_QUEUE_SIZE between them. They are never spilled, so together
+ * they may not hold more than the shared queue does.
+ */
+static size_t queue_part_max(void)
+{
+	return max_t(size_t, MAX_QUEUE_SIZE / partitions, 1);
+}
+
+static int queue_part_writable(struct queue_part_t* part)
+{
+	return READ_ONCE(part->size) < queue_part_max();
+}
+
+static struct queue_part_t* queue_part_get(const void* key, size_t size)
+{
+	return &queue_parts[xxh32(key, size, 0) % partitions];
+}
+
+static int queue_part_push(struct queue_part_t* part, struct queue_elem_t* first, size_t* new_size)
+{
+	int pushed = 0;
+
+	spin_lock(&part->lock);
+	{
+		if (part->size < queue_part_max())
+		{
+			if (part->first != NULL) queue_ins(first, part->first);
+			else part->last = first;
+			part->first = first;
+			*new_size = ++part->size;
+			pushed = 1;
+
+			// The owner can't leave the group while the lock is held
+			if (part->owner) wake_up_interruptible(&part->owner->waits);
+		}
+	}
+	spin_unlock(&part->lock);
+
+	return pushed;
+}
+
+// Takes the oldest message of one of the partitions owned by the member, only that partition is locked
+static struct queue_elem_t* queue_part_pop(struct queue_member_t* member, size_t* new_size)
+{
+	size_t i = 0;
+
+	for (i = 0; i < partitions; i++)
+	{
+		size_t idx = (READ_ONCE(member->next) + i) % partitions;
+		struct queue_part_t* part = &queue_parts[idx];
+		struct queue_elem_t* last = NULL;
+		int full = 0;
+
+		if ((READ_ONCE(part->owner) != member) || !READ_ONCE(part->size)) continue;
+
+		spin_lock(&part->lock);
+		{
+			if ((part->owner == member) && part->size)
+			{
+				full = part->size >= queue_part_max();
+				last = part->last;
+				part->last = queue_prev(last);
+				if (part->first == last) part->first = NULL;
+				queue_rmv(last);
+				*new_size = --part->size;
+			}
+		}
+		spin_unlock(&part->lock);
+
+		// The keyed writers poll the shared wait queue
+		if (full) wake_up_interruptible(&queue_waits);
+
+		if (last)
+		{
+			WRITE_ONCE(member->next, (idx + 1) % partitions);
+			return last;
+		}
+	}
+	return NULL;
+}
+
+static wait_queue_head_t* queue_member_waits(struct queue_member_t* member)
+{
+	return &member->waits;
+}
+
+static int queue_part_ready(struct queue_member_t* member)
+{
+	size_t i = 0;
+
+	for (i = 0; i < partitions; i++)
+	{
+		if ((READ_ONCE(queue_parts[i].owner) == member) && READ_ONCE(queue_parts[i].size)) return 1;
+	}
+	return 0;
+}
+
+static void queue_part_own(struct queue_part_t* part, struct queue_member_t* owner)
+{
+	size_t size = 0;
+
+	spin_lock(&part->lock);
+	{
+		part->owner = owner;
+		size = part->size;
+	}
+	spin_unlock(&part->lock);
+
+	if (owner && size) wake_up_interruptible(&owner->waits);
+}
+
+/*
+ * Spreads the partitions evenly over the members. The partitions stay with their owners
+ * as long as the owners don't get more than their share, so a join or a leave moves as few of them as possible.
+ * queue_group_lock must be held.
+ */
+static void queue_rebalance(void)
+{
+	struct queue_member_t* member = NULL;
+	size_t count = 0;
+	size_t i = 0;
+
+	list_for_each_entry(member, &queue_members, node) count++;
+
+	list_for_each_entry(member, &queue_members, node)
+	{
+		member->quota = partitions / count + ((i++ < partitions % count) ? 1 : 0);
+		member->owned = 0;
+	}
+
+	for (i = 0; i < partitions; i++)
+	{
+		member = queue_parts[i].owner;
+		if (member && (member->owned < member->quota)) member->owned++;
+		else queue_part_own(&queue_parts[i], NULL);
+	}
+
+	for (i = 0; i < partitions; i++)
+	{
+		if (queue_parts[i].owner) continue;
+
+		list_for_each_entry(member, &queue_members, node)
+		{
+			if (member->owned < member->quota) break;
+		}
+		if (&member->node == &queue_members) break;
+
+		member->owned++;
+		queue_part_own(&queue_parts[i], member);
+	}
+
+	printk(KERN_INFO "msg_queue_lkm: %u partition(s) have been rebalanced over %zu consumer(s)\n", partitions, count);
+}
+
+static struct queue_member_t* queue_group_join(void)
+{
+	struct queue_member_t* member = kzalloc(sizeof(struct queue_member_t), GFP_KERNEL);
+	if (!member) return NULL;
+
+	init_waitqueue_head(&member->waits);
+
+	mutex_lock(&queue_group_lock);
+	{
+		list_add_tail(&member->node, &queue_members);
+		queue_rebalance();
+	}
+	mutex_unlock(&queue_group_lock);
+
+	return member;
+}
+
+static void queue_group_leave(struct queue_member_t* member)
+{
+	mutex_lock(&queue_group_lock);
+	{
+		list_del(&member->node);
+		member->quota = 0;
+		member->owned = 0;
+		if (list_empty(&queue_members))
+		{
+			size_t i = 0;
+			for (i = 0; i < partitions; i++) queue_part_own(&queue_parts[i], NULL);
+		}
+		else queue_rebalance();
+	}
+	mutex_unlock(&queue_group_lock);
+
+	kfree(member);
+}
+
+static void queue_part_init(void)
+{
+	size_t i = 0;
+
+	partitions = clamp_t(unsigned int, partitions, 1, MSG_QUEUE_MAX_PARTITIONS);
+	for (i = 0; i < MSG_QUEUE_MAX_PARTITIONS; i++) spin_lock_init(&queue_parts[i].lock);
+}
+
+static void queue_part_del_all(void)
+{
+	size_t i = 0;
+
+	for (i = 0; i < partitions; i++)
+	{
+		struct queue_elem_t* first = NULL;
+
+		spin_lock(&queue_parts[i].lock);
+		{
+			first = queue_parts[i].first;
+			queue_parts[i].first = NULL;
+			queue_parts[i].last = NULL;
+			queue_parts[i].size = 0;
+		}
+		spin_unlock(&queue_parts[i].lock);
+
+		queue_del_all(first);
+	}
+}
@@ -3,47 +3,237 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/xxhash.h>
+#include <linux/refcount.h>
+#include <linux/mutex.h>
+#include <linux/moduleparam.h>
+#include <linux/topology.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+
+struct queue_blob_t
+{
+	struct hlist_node node;
+	refcount_t refs;
+	u64 hash;
+	unsigned long save_gen;
+	size_t save_idx;
+	struct rcu_head rcu;
+	size_t size;
+	char msg[];
+};
 
 struct queue_elem_t
 {
 	struct queue_elem_t* prev;
 	struct queue_elem_t* next;
-	char msg[MAX_MSG_SIZE];
-	size_t size;
+	struct queue_blob_t* blob;
+	struct queue_tenant_t* tenant; // the producer charged for the message
+	u64 seq; // the browse cursor of the message
+	struct rcu_head rcu;
 };
 
-static struct queue_elem_t* queue_crt(void)
+static bool dedup = false;
+module_param(dedup, bool, 0644);
+MODULE_PARM_DESC(dedup, "Share the payload of repeated messages between the queue elements");
+
+static int numa_policy = 0;
+module_param(numa_policy, int, 0644);
+MODULE_PARM_DESC(numa_policy, "Message memory placement: 0 - producer node, 1 - node of the last consumer");
+
+static int queue_consumer_node = NUMA_NO_NODE;
+
+static DEFINE_HASHTABLE(queue_blobs, 10);
+static DEFINE_SPINLOCK(queue_blobs_lock);
+static DEFINE_MUTEX(queue_write_lock);
+
+static unsigned long queue_save_gen = 0;
+
+static struct
+{
+	atomic_long_t elems;
+	atomic_long_t elem_bytes;
+	atomic_long_t blobs;
+	atomic_long_t blob_bytes;
+	atomic_long_t dedup_hits;
+	atomic_long_t node_local[MSG_QUEUE_MAX_NODES];
+	atomic_long_t node_remote[MSG_QUEUE_MAX_NODES];
+}
+queue_stats;
+
+static int queue_node(void)
+{
+	return READ_ONCE(numa_policy) ? READ_ONCE(queue_consumer_node) : NUMA_NO_NODE;
+}
+
+// Remembers the node of the consumer and counts whether the message memory is local to it
+static void queue_consumed(struct queue_elem_t* queue_elem)
+{
+	int node = numa_node_id();
+
+	if (READ_ONCE(queue_consumer_node) != node) WRITE_ONCE(queue_consumer_node, node);
+
+	if (queue_elem && (node < MSG_QUEUE_MAX_NODES))
+	{
+		if (page_to_nid(virt_to_page(queue_elem->blob)) == node) atomic_long_inc(&queue_stats.node_local[node]);
+		else atomic_long_inc(&queue_stats.node_remote[node]);
+	}
+}
+
+static void queue_blob_put(struct queue_blob_t* blob)
+{
+	if (hash_hashed(&blob->node))
+	{
+		if (!refcount_dec_and_lock(&blob->refs, &queue_blobs_lock)) return;
+		hash_del(&blob->node);
+		spin_unlock(&queue_blobs_lock);
+	}
+	else if (!refcount_dec_and_test(&blob->refs)) return;
+
+	atomic_long_dec(&queue_stats.blobs);
+	atomic_long_sub(blob->size, &queue_stats.blob_bytes);
+	kfree_rcu(blob, rcu);
+}
+
+static struct queue_elem_t* queue_crt(gfp_t flags, size_t size)
+{
+    int node = queue_node();
+    struct queue_elem_t* queue_elem = kmalloc_node(sizeof(struct queue_elem_t), flags, node);
+    if (queue_elem)
+    {
+        queue_elem->prev = NULL;
+        queue_elem->next = NULL;
+        queue_elem->tenant = NULL;
+        queue_elem->seq = 0;
+        queue_elem->blob = kmalloc_node(sizeof(struct queue_blob_t) + size, flags, node);
+        if (!queue_elem->blob)
+        {
+            kfree(queue_elem);
+            return NULL;
+        }
+        INIT_HLIST_NODE(&queue_elem->blob->node);
+        refcount_set(&queue_elem->blob->refs, 1);
+        queue_elem->blob->save_gen = 0;
+        queue_elem->blob->size = size;
+
+        atomic_long_inc(&queue_stats.elems);
+        atomic_long_add(size, &queue_stats.elem_bytes);
+        atomic_long_inc(&queue_stats.blobs);
+        atomic_long_add(size, &queue_stats.blob_bytes);
+    }
+    return queue_elem;
+}
+
+static struct queue_elem_t* queue_crt_ref(gfp_t flags, struct queue_elem_t* other)
 {
-    struct queue_elem_t* queue_elem = kmalloc(sizeof(struct queue_elem_t), GFP_KERNEL);
+    struct queue_elem_t* queue_elem = kmalloc_node(sizeof(struct queue_elem_t), flags, queue_node());
     if (queue_elem)
     {
         queue_elem->prev = NULL;
         queue_elem->next = NULL;
-        queue_elem->size = 0;
+        queue_elem->tenant = NULL;
+        queue_elem->seq = 0;
+        queue_elem->blob = other->blob;
+        refcount_inc(&queue_elem->blob->refs);
+
+        atomic_long_inc(&queue_stats.elems);
+        atomic_long_add(queue_elem->blob->size, &queue_stats.elem_bytes);
+        atomic_long_inc(&queue_stats.dedup_hits);
     }
     return queue_elem;
 }
 
 static void queue_del(struct queue_elem_t* queue_elem)
 {
-    kfree(queue_elem);
+    if (queue_elem)
+    {
+        if (queue_elem->tenant) queue_tenant_release(queue_elem->tenant, 1, queue_msg_size(queue_elem));
+        atomic_long_dec(&queue_stats.elems);
+        atomic_long_sub(queue_elem->blob->size, &queue_stats.elem_bytes);
+        queue_blob_put(queue_elem->blob);
+        kfree_rcu(queue_elem, rcu);
+    }
+}
+
+/*
+ * In the dedup mode looks up a payload equal to the element one and shares it instead of keeping a copy.
+ * Must be called once the message has been filled in and before the element is exposed to anybody else.
+ */
+static void queue_share(struct queue_elem_t* queue_elem)
+{
+	struct queue_blob_t* blob = queue_elem->blob;
+	struct queue_blob_t* pos = NULL;
+
+	if (!READ_ONCE(dedup)) return;
+
+	blob->hash = xxh64(blob->msg, blob->size, 0);
+
+	spin_lock(&queue_blobs_lock);
+	{
+		hash_for_each_possible(queue_blobs, pos, node, blob->hash)
+		{
+			if ((pos->hash == blob->hash) && (pos->size == blob->size) && !memcmp(pos->msg, blob->msg, blob->size))
+			{
+				refcount_inc(&pos->refs);
+				break;
+			}
+		}
+		if (!pos) hash_add(queue_blobs, &blob->node, blob->hash);
+	}
+	spin_unlock(&queue_blobs_lock);
+
+	if (pos)
+	{
+		queue_elem->blob = pos;
+		atomic_long_inc(&queue_stats.dedup_hits);
+		queue_blob_put(blob);
+	}
+}
+
+static void queue_stat(struct msg_queue_stat_t* stat)
+{
+	int node = 0;
+
+	stat->elems = atomic_long_read(&queue_stats.elems);
+	stat->elem_bytes = atomic_long_read(&queue_stats.elem_bytes);
+	stat->blobs = atomic_long_read(&queue_stats.blobs);
+	stat->blob_bytes = atomic_long_read(&queue_stats.blob_bytes);
+	stat->dedup_hits = atomic_long_read(&queue_stats.dedup_hits);
+	for (node = 0; node < MSG_QUEUE_MAX_NODES; node++)
+	{
+		stat->node_local[node] = atomic_long_read(&queue_stats.node_local[node]);
+		stat->node_remote[node] = atomic_long_read(&queue_stats.node_remote[node]);
+	}
 }
 
 static char* queue_msg(struct queue_elem_t* queue_elem)
 {
-    if (queue_elem) return queue_elem->msg;
+    if (queue_elem) return queue_elem->blob->msg;
     return NULL;
 }
 
 static size_t queue_msg_size(struct queue_elem_t* queue_elem)
 {
-	if (queue_elem) return queue_elem->size;
+	if (queue_elem) return queue_elem->blob->size;
 	return 0;
 }
 
+// Shrinks the message of a just created element, the payload must not be shared yet
 static void queue_set_msg_size(struct queue_elem_t* queue_elem, size_t size)
 {
-    if (queue_elem) queue_elem->size = size;
+    if (queue_elem && (size < queue_elem->blob->size))
+    {
+        atomic_long_sub(queue_elem->blob->size - size, &queue_stats.elem_bytes);
+        atomic_long_sub(queue_elem->blob->size - size, &queue_stats.blob_bytes);
+        queue_elem->blob->size = size;
+    }
+}
+
+// Charges the tenant for the message, it is released when the element is deleted
+static void queue_set_tenant(struct queue_elem_t* queue_elem, struct queue_tenant_t* tenant)
+{
+	if (queue_elem) queue_elem->tenant = tenant;
 }
 
 static struct queue_elem_t* queue_prev(struct queue_elem_t* queue_elem)
@@ -52,11 +242,85 @@ static struct queue_elem_t* queue_prev(struct queue_elem_t* queue_elem)
 	return NULL;
 }
 
+static struct queue_elem_t* queue_prev_rcu(struct queue_elem_t* queue_elem)
+{
+	if (queue_elem) return rcu_dereference(queue_elem->prev);
+	return NULL;
+}
+
+static struct queue_elem_t* queue_next(struct queue_elem_t* queue_elem)
+{
+	if (queue_elem) return queue_elem->next;
+	return NULL;
+}
+
+static u64 queue_seq(struct queue_elem_t* queue_elem)
+{
+	if (queue_elem) return queue_elem->seq;
+	return 0;
+}
+
+// Numbers the elements from pos to the newest one, queue_lock must be held
+static void queue_number(struct queue_elem_t* pos, u64* seq)
+{
+	for (; pos != NULL; pos = pos->prev) pos->seq = ++*seq;
+}
+
+/*
+ * Adds an element removed from the queue to a list for queue_del_list. The list goes through next only,
+ * prev is left to the browsing readers which may still stand on the element.
+ */
+static struct queue_elem_t* queue_link(struct queue_elem_t* queue_elem, struct queue_elem_t* list)
+{
+	queue_elem->next = list;
+	return queue_elem;
+}
+
+static void queue_del_list(struct queue_elem_t* pos)
+{
+	while (pos != NULL)
+	{
+		struct queue_elem_t* tmp = pos;
+		pos = pos->next;
+		queue_del(tmp);
+	}
+}
+
+static int queue_msg_match(struct queue_elem_t* queue_elem, const struct msg_queue_filter_t* filter)
+{
+    int match = 0;
+    size_t size = queue_msg_size(queue_elem);
+
+    if (filter->offset + filter->size <= size)
+    {
+        const char* pos = queue_msg(queue_elem) + filter->offset;
+        const char* end = queue_msg(queue_elem) + size - filter->size;
+
+        if (!(filter->flags & MSG_QUEUE_FILTER_ANYWHERE)) match = !memcmp(pos, filter->pattern, filter->size);
+        else if (!filter->size) match = 1;
+        else
+        {
+            for (; !match && (pos <= end); pos++)
+            {
+                pos = memchr(pos, filter->pattern[0], end - pos + 1);
+                if (!pos) break;
+                match = !memcmp(pos, filter->pattern, filter->size);
+            }
+        }
+    }
+
+    return (filter->flags & MSG_QUEUE_FILTER_INVERT) ? !match : match;
+}
+
+/*
+ * The browsing readers walk the list from the oldest element through prev under RCU only,
+ * so the elements are published with rcu_assign_pointer and freed after a grace period.
+ */
 static void queue_ins(struct queue_elem_t* queue_elem, struct queue_elem_t* before_this)
 {
     if (before_this)
     {
-        before_this->prev = queue_elem;
+        rcu_assign_pointer(before_this->prev, queue_elem);
         if (queue_elem) queue_elem->next = before_this;
     }
 }
@@ -65,7 +329,7 @@ static void queue_rmv(struct queue_elem_t* queue_elem)
 {
 	if (queue_elem)
 	{
-		if (queue_elem->next) queue_elem->next->prev = queue_elem->prev;
+		if (queue_elem->next) WRITE_ONCE(queue_elem->next->prev, queue_elem->prev);
 		if (queue_elem->prev) queue_elem->prev->next = queue_elem->next;
 	}
 }
@@ -81,74 +345,136 @@ static void queue_del_all(struct queue_elem_t* pos)
     }
 }
 
-static ssize_t queue_read_msg(struct file* fp, ssize_t (*read)(struct file*, char*, size_t, loff_t*), struct queue_elem_t* queue_elem)
+/*
+ * Reads a storage record into a new element. A back reference record shares the payload
+ * of the element read the given number of records before, the chain of which starts at recent.
+ */
+static ssize_t queue_read_msg(struct file* fp, ssize_t (*read)(struct file*, char*, size_t, loff_t*), struct queue_elem_t* recent, struct queue_elem_t** queue_elem)
 {
-	if (queue_elem)
+	size_t size = 0;
+	ssize_t ret = read(fp, (char*)&size, sizeof(size), &fp->f_pos);
+
+	*queue_elem = NULL;
+
+	if (ret != sizeof(size))
+	{
+		if (ret >= 0) ret = -EINVAL;
+	} else
+	if (size & MSG_QUEUE_BACKREF)
+	{
+		size &= ~MSG_QUEUE_BACKREF;
+		for (; recent && (size > 1); size--) recent = queue_next(recent);
+		if (!recent || !size) return -EINVAL;
+		*queue_elem = queue_crt_ref(GFP_KERNEL, recent);
+		ret = *queue_elem ? 0 : -ENOMEM;
+	} else
+	if (size > MAX_MSG_SIZE)
 	{
-		ssize_t ret = read(fp, (char*)&queue_elem->size, sizeof(queue_elem->size), &fp->f_pos);
-		if ((ret != sizeof(queue_elem->size)) || (queue_elem->size > MAX_MSG_SIZE))
+		ret = -EINVAL;
+	}
+	else
+	{
+		*queue_elem = queue_crt(GFP_KERNEL, size);
+		if (!*queue_elem) return -ENOMEM;
+
+		ret = read(fp, queue_msg(*queue_elem), size, &fp->f_pos);
+		if ((ret >= 0) && (size != (size_t)ret)) ret = -EINVAL;
+		if (ret < 0)
 		{
-			if (ret >= 0) ret = -EINVAL;
+			queue_del(*queue_elem);
+			*queue_elem = NULL;
 		}
 		else
 		{
-			ret = read(fp, queue_elem->msg, queue_elem->size, &fp->f_pos);
-			if ((ret > 0) && (queue_elem->size != (size_t)ret)) ret = -EINVAL;
+			queue_share(*queue_elem);
+			ret = 0;
 		}
-		return ret;
 	}
-	return -EFAULT;
+	return ret;
 }
 
 static ssize_t queue_write_msg(struct file* fp, ssize_t (*write)(struct file*, const char*, size_t, loff_t*), struct queue_elem_t* queue_elem)
 {
 	if (queue_elem)
 	{
-		ssize_t ret = write(fp, (char*)&queue_elem->size, sizeof(queue_elem->size), &fp->f_pos);
-		if (ret != sizeof(queue_elem->size))
+		ssize_t ret = write(fp, (char*)&queue_elem->blob->size, sizeof(queue_elem->blob->size), &fp->f_pos);
+		if (ret != sizeof(queue_elem->blob->size))
 		{
 			if (ret >= 0) ret = -EFAULT ;
 		}
 		else
 		{
-			ret = write(fp, queue_elem->msg, queue_elem->size, &fp->f_pos);
-			if ((ret > 0) && (queue_elem->size != (size_t)ret)) ret = -EINVAL;
+			ret = write(fp, queue_elem->blob->msg, queue_elem->blob->size, &fp->f_pos);
+			if ((ret > 0) && (queue_elem->blob->size != (size_t)ret)) ret = -EINVAL;
 		}
 		return ret;
 	}
 	return -EFAULT;
 }
 
+static ssize_t queue_write_ref(struct file* fp, ssize_t (*write)(struct file*, const char*, size_t, loff_t*), size_t distance)
+{
+	size_t size = MSG_QUEUE_BACKREF | distance;
+	ssize_t ret = write(fp, (char*)&size, sizeof(size), &fp->f_pos);
+	if ((ret >= 0) && (ret != sizeof(size))) ret = -EFAULT;
+	return ret;
+}
+
 static ssize_t queue_read(struct file* fp, ssize_t (*read)(struct file*, char*, size_t, loff_t*), size_t max_size, struct queue_elem_t** first, struct queue_elem_t** last)
 {
-	struct queue_elem_t* queue_elem = queue_crt();
-	if (queue_elem)
+	size_t size = 0;
+	ssize_t ret = 0;
+	struct queue_elem_t* prev = NULL;
+
+	*first = *last = NULL;
+	while((size != max_size) && !(ret = queue_read_msg(fp, read, *first, &prev)))
 	{
-		size_t size = 0;
-		*first = NULL;
-		while((size != max_size) && (queue_read_msg(fp, read, queue_elem) == queue_elem->size))
-		{
-			struct queue_elem_t* prev = queue_crt();
-			*prev = *queue_elem;
-			if (!prev) { queue_del_all(*first); *first = *last = NULL; return -ENOMEM; }
-			if (!*first) { *first = *last = prev; }
-			else { queue_ins(prev, *first); *first = prev; };
-			size++;
-		}
-		queue_del(queue_elem);
-		return size;
+		if (!*first) { *first = *last = prev; }
+		else { queue_ins(prev, *first); *first = prev; };
+		size++;
+	}
+
+	if (ret == -ENOMEM)
+	{
+		queue_del_all(*first);
+		*first = *last = NULL;
+		return -ENOMEM;
 	}
-	return -ENOMEM;
+	return size;
 }
 
-static ssize_t queue_write(struct file* fp, ssize_t (*write)(struct file*, const char*, size_t, loff_t*), struct queue_elem_t* pos)
+/*
+ * Writes up to count elements from pos towards the newest one. Payloads shared through deduplication
+ * are written once, the following occurrences are written as back references to the first one.
+ */
+static ssize_t queue_write(struct file* fp, ssize_t (*write)(struct file*, const char*, size_t, loff_t*), struct queue_elem_t* pos, size_t count)
 {
 	size_t size = 0;
-	for (;pos != NULL; pos = pos->prev, size++)
+	unsigned long gen = 0;
+
+	mutex_lock(&queue_write_lock);
+	gen = ++queue_save_gen;
+
+	for (;(pos != NULL) && (size != count); pos = pos->prev, size++)
 	{
-		ssize_t ret = queue_write_msg(fp, write, pos);
-		if (ret < 0) return ret;
+		struct queue_blob_t* blob = pos->blob;
+		ssize_t ret = 0;
+
+		if (hash_hashed(&blob->node) && (blob->save_gen == gen)) ret = queue_write_ref(fp, write, size - blob->save_idx);
+		else
+		{
+			ret = queue_write_msg(fp, write, pos);
+			blob->save_gen = gen;
+			blob->save_idx = size;
+		}
+
+		if (ret < 0)
+		{
+			mutex_unlock(&queue_write_lock);
+			return ret;
+		}
 	}
+
+	mutex_unlock(&queue_write_lock);
 	return size;
 }
-
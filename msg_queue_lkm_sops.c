@@ -0,0 +1,305 @@
+#include "msg_queue.h"
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
+#include <linux/moduleparam.h>
+
+/*
+ * Under memory pressure the oldest messages are moved to the spill file and read back
+ * when the consumers get to them. The queue is then made of three parts, from the oldest:
+ * the ahead elements already read back, the records of the spill file and the rest of the elements.
+ */
+
+static char* spill_path = "/var/lib/" DEVICE_NAME ".spill";
+module_param(spill_path, charp, 0444);
+MODULE_PARM_DESC(spill_path, "The file the queue is spilled to under memory pressure, empty - never spill");
+
+static struct
+{
+	struct file* fp;
+	loff_t read_pos;  // the oldest record not read back yet
+	loff_t write_pos; // the end of the records
+	atomic_long_t wanted; // elements the shrinker asked to spill
+}
+queue_spill;
+
+static void queue_spill_fn(struct work_struct* work_data);
+static void queue_fill_fn(struct work_struct* work_data);
+
+static DECLARE_WORK(queue_spill_work, queue_spill_fn);
+static DECLARE_WORK(queue_fill_work, queue_fill_fn);
+
+// The oldest element which is not ahead, NULL if all of them are ahead (the newest one is queue.first then).
+// queue_lock must be held
+static struct queue_elem_t* queue_behind(void)
+{
+	struct queue_elem_t* pos = queue.last;
+	size_t ahead = queue.ahead;
+
+	for (; pos && ahead; ahead--) pos = queue_prev(pos);
+	return pos;
+}
+
+static unsigned long queue_spill_count(struct shrinker* shrinker, struct shrink_control* sc)
+{
+	size_t size = READ_ONCE(queue.size);
+	size_t ahead = READ_ONCE(queue.ahead);
+
+	if (!spill_path[0] || !queue_works) return 0;
+	if (size <= ahead + SPILL_KEEP) return 0;
+	return size - ahead - SPILL_KEEP;
+}
+
+// Writing to a file can't be done in the reclaim context, so the spilling is left to the workqueue
+static unsigned long queue_spill_scan(struct shrinker* shrinker, struct shrink_control* sc)
+{
+	atomic_long_add(sc->nr_to_scan, &queue_spill.wanted);
+	queue_work(queue_works, &queue_spill_work);
+	return SHRINK_STOP;
+}
+
+static struct shrinker queue_shrinker =
+{
+	.count_objects = queue_spill_count,
+	.scan_objects = queue_spill_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+// Drops the spilled records, queue_spill_lock must be held
+static void queue_spill_reset(void)
+{
+	queue_spill.read_pos = 0;
+	queue_spill.write_pos = 0;
+	if (queue_spill.fp) vfs_truncate(&queue_spill.fp->f_path, 0);
+}
+
+static void queue_spill_fn(struct work_struct* work_data)
+{
+	struct queue_elem_t* oldest = NULL;
+	struct queue_elem_t* newest = NULL;
+	struct queue_elem_t* stays = NULL;
+	struct queue_elem_t* pos = NULL;
+	size_t count = 0;
+	size_t wanted = atomic_long_xchg(&queue_spill.wanted, 0);
+	ssize_t ret = 0;
+
+	mutex_lock(&queue_spill_lock);
+
+	if (!queue_spill.fp)
+	{
+		struct file* fp = NULL;
+		int err = file_unlink(spill_path);
+
+		// A new file, whatever was left at the path (a symlink planted there included) is never written through
+		fp = ((err == 0) || (err == -ENOENT)) ? file_open(spill_path, O_CREAT | O_EXCL | O_NOFOLLOW | O_RDWR, 0600) : ERR_PTR(err);
+		if (IS_ERR(fp))
+		{
+			mutex_unlock(&queue_spill_lock);
+			printk(KERN_ALERT "msg_queue_lkm: failed to open the spill file [%s]\n", spill_path);
+			return;
+		}
+		queue_spill.fp = fp;
+	}
+
+	spin_lock(&queue_lock);
+	{
+		size_t behind = queue.size - queue.ahead;
+
+		wanted = (behind > SPILL_KEEP) ? min(wanted, behind - SPILL_KEEP) : 0;
+		oldest = stays = queue_behind();
+		for (; count < wanted; count++)
+		{
+			newest = stays;
+			stays = queue_prev(stays);
+		}
+
+		if (count)
+		{
+			// The elements from oldest to newest leave the list, the spill file takes their place
+			struct queue_elem_t* ahead = queue_next(oldest);
+
+			stays->next = ahead;
+			if (ahead) WRITE_ONCE(ahead->prev, stays);
+			else WRITE_ONCE(queue.last, stays);
+
+			queue.size -= count;
+			queue.spilled += count;
+		}
+	}
+	spin_unlock(&queue_lock);
+
+	if (!count)
+	{
+		mutex_unlock(&queue_spill_lock);
+		return;
+	}
+
+	queue_spill.fp->f_pos = queue_spill.write_pos;
+	for (pos = oldest; (pos != stays) && (ret >= 0); pos = queue_prev(pos)) ret = queue_write_msg(queue_spill.fp, file_write, pos);
+
+	if (ret < 0)
+	{
+		// The elements go back to the list, they are still the oldest after the spilled ones
+		spin_lock(&queue_lock);
+		{
+			struct queue_elem_t* behind = queue_behind();
+			struct queue_elem_t* ahead = behind ? queue_next(behind) : queue.first;
+
+			oldest->next = ahead;
+			newest->prev = behind;
+			if (behind) behind->next = newest;
+			else rcu_assign_pointer(queue.first, newest);
+
+			if (ahead) rcu_assign_pointer(ahead->prev, oldest);
+			else rcu_assign_pointer(queue.last, oldest);
+
+			queue.size += count;
+			queue.spilled -= count;
+			queue.gen++;
+		}
+		spin_unlock(&queue_lock);
+
+		mutex_unlock(&queue_spill_lock);
+		wake_up_interruptible(&queue_waits);
+		printk(KERN_ALERT "msg_queue_lkm: failed to spill %zu message(s) to the file [%s]\n", count, spill_path);
+		return;
+	}
+
+	queue_spill.write_pos = queue_spill.fp->f_pos;
+	mutex_unlock(&queue_spill_lock);
+
+	for (pos = oldest; pos != stays;)
+	{
+		struct queue_elem_t* tmp = pos;
+		pos = queue_prev(pos);
+		queue_del(tmp);
+	}
+
+	printk(KERN_INFO "msg_queue_lkm: %zu message(s) have been spilled to the file\n", count);
+}
+
+static void queue_fill_fn(struct work_struct* work_data)
+{
+	struct queue_elem_t* first = NULL;
+	struct queue_elem_t* last = NULL;
+	size_t wanted = 0;
+	size_t lost = 0;
+	int empty = 0;
+	ssize_t ret = 0;
+
+	mutex_lock(&queue_spill_lock);
+
+	wanted = min_t(size_t, READ_ONCE(queue.spilled), SPILL_FILL_BATCH);
+	if (!wanted || !queue_spill.fp)
+	{
+		mutex_unlock(&queue_spill_lock);
+		return;
+	}
+
+	queue_spill.fp->f_pos = queue_spill.read_pos;
+	ret = queue_read(queue_spill.fp, file_read, wanted, &first, &last);
+	if (ret < 0)
+	{
+		// Out of memory, the next reader will try again
+		mutex_unlock(&queue_spill_lock);
+		return;
+	}
+	queue_spill.read_pos = queue_spill.fp->f_pos;
+
+	spin_lock(&queue_lock);
+	{
+		if (ret > 0)
+		{
+			// The records read go right after the ahead elements
+			struct queue_elem_t* behind = queue_behind();
+			struct queue_elem_t* ahead = behind ? queue_next(behind) : queue.first;
+
+			queue_number(last, &queue.seq);
+			last->next = ahead;
+			first->prev = behind;
+			if (behind) behind->next = first;
+			else rcu_assign_pointer(queue.first, first);
+
+			if (ahead) rcu_assign_pointer(ahead->prev, last);
+			else rcu_assign_pointer(queue.last, last);
+
+			queue.size += ret;
+			queue.ahead += ret;
+			queue.spilled -= ret;
+		}
+
+		if ((size_t)ret != wanted)
+		{
+			lost = queue.spilled;
+			queue.spilled = 0;
+		}
+		empty = !queue.spilled;
+		queue.gen++;
+	}
+	spin_unlock(&queue_lock);
+
+	if (empty) queue_spill_reset();
+	mutex_unlock(&queue_spill_lock);
+
+	if (lost) printk(KERN_ALERT "msg_queue_lkm: %zu spilled message(s) have been lost\n", lost);
+	wake_up_interruptible(&queue_waits);
+}
+
+static void queue_spill_fill(void)
+{
+	if (queue_works) queue_work(queue_works, &queue_fill_work);
+}
+
+// Reads the next spilled messages back and waits for them
+static void queue_spill_wait(void)
+{
+	if (!queue_works) return;
+	queue_work(queue_works, &queue_fill_work);
+	flush_work(&queue_fill_work);
+}
+
+// Appends the spilled records to the storage file, queue_spill_lock must be held
+static ssize_t queue_spill_save(struct file* fp, ssize_t (*write)(struct file*, const char*, size_t, loff_t*), size_t count)
+{
+	loff_t pos = queue_spill.read_pos;
+	size_t size = 0;
+
+	for (; size != count; size++)
+	{
+		struct queue_elem_t* queue_elem = NULL;
+		ssize_t ret = 0;
+
+		queue_spill.fp->f_pos = pos;
+		ret = queue_read_msg(queue_spill.fp, file_read, NULL, &queue_elem);
+		pos = queue_spill.fp->f_pos;
+
+		if (!ret) ret = queue_write_msg(fp, write, queue_elem);
+		queue_del(queue_elem);
+		if (ret < 0) return ret;
+	}
+	return size;
+}
+
+static void queue_spill_init(void)
+{
+	if (register_shrinker(&queue_shrinker)) printk(KERN_ALERT "msg_queue_lkm: failed to register the shrinker, the queue won't be spilled\n");
+}
+
+static void queue_spill_exit(void)
+{
+	unregister_shrinker(&queue_shrinker);
+	cancel_work_sync(&queue_spill_work);
+	cancel_work_sync(&queue_fill_work);
+
+	if (queue_spill.fp)
+	{
+		queue_spill_reset();
+		file_close(queue_spill.fp);
+		queue_spill.fp = NULL;
+	}
+	queue.spilled = 0;
+	queue.ahead = 0;
+}
@@ -0,0 +1,198 @@
+#include "msg_queue.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/hashtable.h>
+#include <linux/cred.h>
+#include <linux/uidgid.h>
+#include <linux/moduleparam.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
+
+/*
+ * Producers are accounted per fsuid: the messages and bytes they keep in the queue
+ * and a token bucket limiting their push rate.
+ */
+struct queue_tenant_t
+{
+	struct hlist_node node;
+	kuid_t uid;
+	size_t msgs;
+	size_t bytes;
+	u64 tokens; // ns worth of pushes at the configured rate
+	u64 refill; // local_clock() of the last refill
+	unsigned long rejected;
+	unsigned long throttled;
+};
+
+static unsigned int quota_msgs = 0;
+module_param(quota_msgs, uint, 0644);
+MODULE_PARM_DESC(quota_msgs, "Messages a user may keep in the queue, 0 - unlimited");
+
+static unsigned long quota_bytes = 0;
+module_param(quota_bytes, ulong, 0644);
+MODULE_PARM_DESC(quota_bytes, "Message bytes a user may keep in the queue, 0 - unlimited");
+
+static unsigned int push_rate = 0;
+module_param(push_rate, uint, 0644);
+MODULE_PARM_DESC(push_rate, "Messages per second a user may push, 0 - unlimited");
+
+static unsigned int push_burst = 0;
+module_param(push_burst, uint, 0644);
+MODULE_PARM_DESC(push_burst, "Messages a user may push at once above the rate, push_rate by default");
+
+static DEFINE_HASHTABLE(queue_tenants, 6);
+static DEFINE_SPINLOCK(queue_tenants_lock);
+
+static struct queue_tenant_t* queue_tenant_find(kuid_t uid)
+{
+	struct queue_tenant_t* tenant = NULL;
+
+	hash_for_each_possible(queue_tenants, tenant, node, __kuid_val(uid))
+	{
+		if (uid_eq(tenant->uid, uid)) break;
+	}
+	return tenant;
+}
+
+// The bucket holds push_burst pushes worth of tokens, push_rate of them by default
+static u64 queue_tenant_capacity(unsigned int rate)
+{
+	if (!rate) return 0;
+	return (NSEC_PER_SEC / rate) * (push_burst ? push_burst : rate);
+}
+
+static struct queue_tenant_t* queue_tenant_get(void)
+{
+	kuid_t uid = current_fsuid();
+	struct queue_tenant_t* tenant = NULL;
+	struct queue_tenant_t* found = NULL;
+
+	spin_lock(&queue_tenants_lock);
+	{
+		found = queue_tenant_find(uid);
+	}
+	spin_unlock(&queue_tenants_lock);
+
+	if (found) return found;
+
+	tenant = kzalloc(sizeof(struct queue_tenant_t), GFP_KERNEL);
+	if (!tenant) return NULL;
+
+	tenant->uid = uid;
+	tenant->tokens = queue_tenant_capacity(READ_ONCE(push_rate)); // a new producer may burst at once
+	tenant->refill = local_clock();
+
+	spin_lock(&queue_tenants_lock);
+	{
+		found = queue_tenant_find(uid);
+		if (!found) hash_add(queue_tenants, &tenant->node, __kuid_val(uid));
+	}
+	spin_unlock(&queue_tenants_lock);
+
+	if (!found) return tenant;
+
+	kfree(tenant);
+	return found;
+}
+
+/*
+ * Charges the tenant with a message of the given size. Quota violations are rejected with -EDQUOT,
+ * a producer out of tokens waits for them or gets -EAGAIN if it must not block.
+ */
+static int queue_tenant_acquire(struct queue_tenant_t* tenant, size_t size, int nonblock)
+{
+	for (;;)
+	{
+		u64 wait = 0;
+		unsigned int rate = READ_ONCE(push_rate);
+
+		spin_lock(&queue_tenants_lock);
+		{
+			if ((quota_msgs && (tenant->msgs + 1 > quota_msgs)) || (quota_bytes && (tenant->bytes + size > quota_bytes)))
+			{
+				tenant->rejected++;
+				spin_unlock(&queue_tenants_lock);
+				return -EDQUOT;
+			}
+
+			if (rate)
+			{
+				u64 now = local_clock();
+				u64 cost = NSEC_PER_SEC / rate;
+				u64 capacity = queue_tenant_capacity(rate);
+
+				if (now > tenant->refill) tenant->tokens = min(tenant->tokens + (now - tenant->refill), capacity);
+				tenant->refill = now;
+
+				if (tenant->tokens < cost)
+				{
+					wait = cost - tenant->tokens;
+					tenant->throttled++;
+				}
+				else tenant->tokens -= cost;
+			}
+
+			if (!wait)
+			{
+				tenant->msgs++;
+				tenant->bytes += size;
+			}
+		}
+		spin_unlock(&queue_tenants_lock);
+
+		if (!wait) return 0;
+		if (nonblock) return -EAGAIN;
+		if (schedule_timeout_interruptible(max(nsecs_to_jiffies(wait), 1UL)) || signal_pending(current)) return -EINTR;
+	}
+}
+
+static void queue_tenant_release(struct queue_tenant_t* tenant, size_t msgs, size_t size)
+{
+	spin_lock(&queue_tenants_lock);
+	{
+		tenant->msgs -= msgs;
+		tenant->bytes -= size;
+	}
+	spin_unlock(&queue_tenants_lock);
+}
+
+static void queue_tenant_stat(struct msg_queue_tenants_t* tenants)
+{
+	struct queue_tenant_t* tenant = NULL;
+	int bkt = 0;
+
+	tenants->count = 0;
+
+	spin_lock(&queue_tenants_lock);
+	{
+		hash_for_each(queue_tenants, bkt, tenant, node)
+		{
+			struct msg_queue_tenant_stat_t* stat = NULL;
+
+			if (tenants->count == MSG_QUEUE_MAX_TENANTS) break;
+			stat = &tenants->tenants[tenants->count];
+
+			stat->uid = from_kuid_munged(current_user_ns(), tenant->uid);
+			stat->msgs = tenant->msgs;
+			stat->bytes = tenant->bytes;
+			stat->rejected = tenant->rejected;
+			stat->throttled = tenant->throttled;
+			tenants->count++;
+		}
+	}
+	spin_unlock(&queue_tenants_lock);
+}
+
+static void queue_tenant_del_all(void)
+{
+	struct queue_tenant_t* tenant = NULL;
+	struct hlist_node* tmp = NULL;
+	int bkt = 0;
+
+	hash_for_each_safe(queue_tenants, bkt, tmp, tenant, node)
+	{
+		hash_del(&tenant->node);
+		kfree(tenant);
+	}
+}
@@ -0,0 +1,544 @@
+#include "msg_queue_lib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define LOADGEN_MAGIC 0x4d51474cU // "LGQM"
+#define LOADGEN_STOP  UINT32_MAX  // seq of the message which stops a consumer
+
+#define POP_BATCH 32
+
+#define STOP_TIMEOUT_NS 5000000000LL // consumers draining nothing for that long after the stop get their stop messages again
+
+// Log-linear latency histogram: exact below 64 ns, 32 sub-buckets (~3% precision) per power of two above
+#define HIST_SUB_BITS 5
+#define HIST_SIZE     (64 + (64 - 6) * (1 << HIST_SUB_BITS))
+
+struct header_t
+{
+	uint32_t magic;
+	uint32_t seq;
+	int64_t sched_ns; // the time the message was due to be sent, latencies are measured from it
+};
+
+struct hist_t
+{
+	uint64_t counts[HIST_SIZE];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct options_t
+{
+	const char* backend;
+	const char* file;
+	const char* storage;
+	size_t size;
+	int producers;
+	int consumers;
+	double rate;     // messages per second over all the producers, 0 - as fast as possible
+	double duration; // seconds
+};
+
+struct payload_t
+{
+	char* msg;
+	size_t size;
+};
+
+struct producer_t
+{
+	pthread_t thread;
+	const struct options_t* options;
+	const struct payload_t* payloads;
+	size_t payload_count;
+	int index;
+	int64_t start_ns;
+	uint64_t sent;
+	uint64_t dropped;
+};
+
+struct consumer_t
+{
+	pthread_t thread;
+	const struct options_t* options;
+	FILE* storage;
+	pthread_mutex_t* storage_lock;
+	struct hist_t hist;
+	uint64_t received;
+	uint64_t bytes;
+	uint64_t foreign;
+	int64_t last_ns;
+	int done;
+};
+
+int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void sleep_until(int64_t ns)
+{
+	struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+int hist_index(uint64_t value)
+{
+	int msb;
+	if (value < 64) return value;
+	msb = 63 - __builtin_clzll(value);
+	return 64 + (msb - 6) * (1 << HIST_SUB_BITS) + (int)((value >> (msb - HIST_SUB_BITS)) - (1 << HIST_SUB_BITS));
+}
+
+uint64_t hist_value(int index)
+{
+	int msb;
+	if (index < 64) return index;
+	msb = (index - 64) / (1 << HIST_SUB_BITS) + 6;
+	return (uint64_t)((index - 64) % (1 << HIST_SUB_BITS) + (1 << HIST_SUB_BITS)) << (msb - HIST_SUB_BITS);
+}
+
+void hist_add(struct hist_t* hist, uint64_t value)
+{
+	if (!hist->total || (value < hist->min)) hist->min = value;
+	if (value > hist->max) hist->max = value;
+	hist->counts[hist_index(value)]++;
+	hist->sum += value;
+	hist->total++;
+}
+
+void hist_merge(struct hist_t* to, const struct hist_t* from)
+{
+	int i;
+	if (!from->total) return;
+	if (!to->total || (from->min < to->min)) to->min = from->min;
+	if (from->max > to->max) to->max = from->max;
+	for (i = 0; i < HIST_SIZE; i++) to->counts[i] += from->counts[i];
+	to->sum += from->sum;
+	to->total += from->total;
+}
+
+uint64_t hist_percentile(const struct hist_t* hist, double percentile)
+{
+	uint64_t rank = (uint64_t)(percentile / 100.0 * hist->total + 0.5);
+	uint64_t seen = 0;
+	int i;
+
+	if (!rank) rank = 1;
+	for (i = 0; i < HIST_SIZE; i++)
+	{
+		seen += hist->counts[i];
+		if (seen >= rank) return (hist_value(i) > hist->max) ? hist->max : hist_value(i);
+	}
+	return hist->max;
+}
+
+// Reads the messages of a storage file (the daemon and SAVE format), a malformed record ends the file
+ssize_t payloads_load(const char* path, struct payload_t** payloads)
+{
+	FILE* in = fopen(path, "rb");
+	size_t count = 0;
+	size_t capacity = 0;
+	size_t size = 0;
+
+	if (!in) return -1;
+
+	*payloads = NULL;
+	while (fread(&size, sizeof(size), 1, in) == 1)
+	{
+		struct payload_t payload;
+
+		if (count == capacity)
+		{
+			struct payload_t* tmp = realloc(*payloads, (capacity = capacity ? 2 * capacity : 1024) * sizeof(struct payload_t));
+			if (!tmp) break;
+			*payloads = tmp;
+		}
+
+		if (size & MSG_QUEUE_BACKREF)
+		{
+			size &= ~MSG_QUEUE_BACKREF;
+			if (!size || (size > count)) break;
+			payload = (*payloads)[count - size];
+			payload.msg = malloc(payload.size + 1);
+			if (!payload.msg) break;
+			memcpy(payload.msg, (*payloads)[count - size].msg, payload.size);
+		}
+		else
+		{
+			if (size > MAX_MSG_SIZE) break;
+			payload.size = size;
+			payload.msg = malloc(size + 1);
+			if (!payload.msg) break;
+			if (fread(payload.msg, 1, size, in) != size)
+			{
+				free(payload.msg);
+				break;
+			}
+		}
+		(*payloads)[count++] = payload;
+	}
+
+	fclose(in);
+	return count;
+}
+
+void* produce(void* arg)
+{
+	struct producer_t* producer = arg;
+	const struct options_t* options = producer->options;
+	int64_t interval = options->rate > 0 ? (int64_t)(1e9 * options->producers / options->rate) : 0;
+	int64_t end = producer->start_ns + (int64_t)(options->duration * 1e9);
+	char* buffer = malloc(MAX_MSG_SIZE);
+	struct msg_queue_t* queue = msg_queue_open(options->backend, O_WRONLY);
+	struct header_t header = { LOADGEN_MAGIC, 0, 0 };
+
+	if (!buffer || !queue)
+	{
+		perror("Failed to start a producer");
+		free(buffer);
+		if (queue) msg_queue_close(queue);
+		return NULL;
+	}
+
+	// Open loop: every message has its own send time whether or not the previous one was late
+	for (header.seq = 0;; header.seq++)
+	{
+		const struct payload_t* payload = &producer->payloads[(header.seq * options->producers + producer->index) % producer->payload_count];
+		size_t size = sizeof(header) + payload->size;
+
+		header.sched_ns = interval ? producer->start_ns + interval * header.seq + interval * producer->index / options->producers : now_ns();
+		if (header.sched_ns >= end) break;
+		if (interval) sleep_until(header.sched_ns);
+
+		if (size > MAX_MSG_SIZE) size = MAX_MSG_SIZE;
+		memcpy(buffer, &header, sizeof(header));
+		memcpy(buffer + sizeof(header), payload->msg, size - sizeof(header));
+
+		if (msg_queue_push(queue, buffer, size) < 0) producer->dropped++;
+		else producer->sent++;
+	}
+
+	msg_queue_close(queue);
+	free(buffer);
+	return NULL;
+}
+
+// Pushes count stop messages, waiting for free space
+int push_stops(struct msg_queue_t* queue, int count)
+{
+	struct header_t header = { LOADGEN_MAGIC, LOADGEN_STOP, 0 };
+
+	for (; count > 0; count--)
+	{
+		while (msg_queue_push(queue, &header, sizeof(header)) < 0)
+		{
+			if (errno != EFULL) return -1;
+			usleep(1000);
+		}
+	}
+	return 0;
+}
+
+void* consume(void* arg)
+{
+	struct consumer_t* consumer = arg;
+	struct msg_queue_t* queue = msg_queue_open(consumer->options->backend, O_RDWR);
+	char* buffers = malloc((size_t)POP_BATCH * MSG_QUEUE_BATCH_BUFFER);
+	struct msg_queue_filter_t filter = {0};
+	uint32_t magic = LOADGEN_MAGIC;
+	struct iovec msgs[POP_BATCH];
+	int stops = 0;
+
+	// Only take the loadgen messages of the device, anything else stays in the queue for its readers
+	filter.size = sizeof(magic);
+	memcpy(filter.pattern, &magic, sizeof(magic));
+
+	if (!buffers || !queue || ((msg_queue_ioctl(queue, MSG_QUEUE_SET_FILTER, &filter) < 0) && (errno != ENOTTY)))
+	{
+		perror("Failed to start a consumer");
+		free(buffers);
+		if (queue) msg_queue_close(queue);
+		__atomic_store_n(&consumer->done, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	while (!stops)
+	{
+		ssize_t popped;
+		ssize_t i;
+		int64_t received;
+
+		for (i = 0; i < POP_BATCH; i++)
+		{
+			msgs[i].iov_base = buffers + i * MSG_QUEUE_BATCH_BUFFER;
+			msgs[i].iov_len = MSG_QUEUE_BATCH_BUFFER;
+		}
+
+		popped = msg_queue_pop_batch(queue, msgs, POP_BATCH);
+		received = now_ns();
+
+		if (popped < 0)
+		{
+			if (errno == EEMPTY) continue;
+			perror("Failed to pop messages");
+			break;
+		}
+
+		for (i = 0; i < popped; i++)
+		{
+			struct header_t header;
+
+			if (msgs[i].iov_len < sizeof(header)) { consumer->foreign++; continue; }
+			memcpy(&header, msgs[i].iov_base, sizeof(header));
+			if (header.magic != LOADGEN_MAGIC) { consumer->foreign++; continue; }
+			if (header.seq == LOADGEN_STOP) { stops++; continue; }
+
+			hist_add(&consumer->hist, received > header.sched_ns ? received - header.sched_ns : 0);
+			consumer->received++;
+			consumer->bytes += msgs[i].iov_len;
+			consumer->last_ns = received;
+
+			if (consumer->storage)
+			{
+				pthread_mutex_lock(consumer->storage_lock);
+				fwrite(&msgs[i].iov_len, sizeof(msgs[i].iov_len), 1, consumer->storage);
+				fwrite(msgs[i].iov_base, 1, msgs[i].iov_len, consumer->storage);
+				pthread_mutex_unlock(consumer->storage_lock);
+			}
+		}
+
+		// Every consumer takes one stop message, the others are left to the rest
+		if ((stops > 1) && (push_stops(queue, stops - 1) < 0)) perror("Failed to return the stop messages");
+	}
+
+	msg_queue_close(queue);
+	free(buffers);
+	__atomic_store_n(&consumer->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * Stops the consumers once the queue has been drained and waits for them. Another reader of the queue,
+ * such as a running msg_queue_dmn, may take the stop messages, so they are pushed again for the consumers
+ * still running once these have drained nothing for STOP_TIMEOUT_NS.
+ */
+int stop_consumers(const struct options_t* options, struct consumer_t* consumers)
+{
+	struct msg_queue_t* queue = msg_queue_open(options->backend, O_WRONLY);
+	int64_t deadline = now_ns() + STOP_TIMEOUT_NS;
+	uint64_t received = 0;
+	int competing = 0;
+	int ret = -1;
+	int i;
+
+	if (!queue) return -1;
+	if (push_stops(queue, options->consumers) < 0) goto exit;
+
+	for (;;)
+	{
+		uint64_t total = 0;
+		int running = 0;
+
+		for (i = 0; i < options->consumers; i++)
+		{
+			total += __atomic_load_n(&consumers[i].received, __ATOMIC_RELAXED);
+			running += !__atomic_load_n(&consumers[i].done, __ATOMIC_ACQUIRE);
+		}
+		if (!running) break;
+
+		if (total != received)
+		{
+			received = total;
+			deadline = now_ns() + STOP_TIMEOUT_NS;
+		}
+		else if (now_ns() >= deadline)
+		{
+			if (!competing++) fprintf(stderr, "The stop messages are taken by another reader of the queue (is %s running?)\n", DAEMON_NAME);
+			if (push_stops(queue, running) < 0) goto exit;
+			deadline = now_ns() + STOP_TIMEOUT_NS / 50;
+		}
+		usleep(10000);
+	}
+	ret = 0;
+
+exit:
+	msg_queue_close(queue);
+	return ret;
+}
+
+void report(const struct options_t* options, const struct producer_t* producers, const struct consumer_t* consumers, int64_t start_ns)
+{
+	struct hist_t* hist = calloc(1, sizeof(struct hist_t));
+	uint64_t sent = 0, dropped = 0, received = 0, bytes = 0, foreign = 0;
+	int64_t last_ns = start_ns;
+	double elapsed;
+	int i;
+
+	if (!hist) return;
+
+	for (i = 0; i < options->producers; i++)
+	{
+		sent += producers[i].sent;
+		dropped += producers[i].dropped;
+	}
+	for (i = 0; i < options->consumers; i++)
+	{
+		hist_merge(hist, &consumers[i].hist);
+		received += consumers[i].received;
+		bytes += consumers[i].bytes;
+		foreign += consumers[i].foreign;
+		if (consumers[i].last_ns > last_ns) last_ns = consumers[i].last_ns;
+	}
+	elapsed = (last_ns - start_ns) / 1e9;
+
+	printf("{\n");
+	printf("  \"backend\": \"%s\",\n", options->backend ? options->backend : (getenv(MSG_QUEUE_BACKEND_ENV) ? getenv(MSG_QUEUE_BACKEND_ENV) : "dev"));
+	printf("  \"payloads\": \"%s\",\n", options->file ? options->file : "synthetic");
+	printf("  \"size\": %zu,\n", options->size);
+	printf("  \"producers\": %d,\n", options->producers);
+	printf("  \"consumers\": %d,\n", options->consumers);
+	printf("  \"rate\": %.0f,\n", options->rate);
+	printf("  \"duration\": %.3f,\n", options->duration);
+	printf("  \"sent\": %llu,\n", (unsigned long long)sent);
+	printf("  \"dropped\": %llu,\n", (unsigned long long)dropped);
+	printf("  \"received\": %llu,\n", (unsigned long long)received);
+	printf("  \"foreign\": %llu,\n", (unsigned long long)foreign);
+	printf("  \"throughput\": { \"msgs_per_sec\": %.1f, \"bytes_per_sec\": %.1f },\n",
+		elapsed > 0 ? received / elapsed : 0.0, elapsed > 0 ? bytes / elapsed : 0.0);
+	printf("  \"latency_ns\": { \"min\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+		"\"p999\": %llu, \"p9999\": %llu, \"max\": %llu }\n",
+		(unsigned long long)hist->min, hist->total ? (double)hist->sum / hist->total : 0.0,
+		(unsigned long long)hist_percentile(hist, 50), (unsigned long long)hist_percentile(hist, 90),
+		(unsigned long long)hist_percentile(hist, 99), (unsigned long long)hist_percentile(hist, 99.9),
+		(unsigned long long)hist_percentile(hist, 99.99), (unsigned long long)hist->max);
+	printf("}\n");
+
+	free(hist);
+}
+
+void usage(const char* name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -b backend   message queue backend (see msg_queue_lib.h), $" MSG_QUEUE_BACKEND_ENV " by default\n"
+		"  -f file      replay the messages of a storage file instead of synthetic ones\n"
+		"  -s size      synthetic message size, bytes (128)\n"
+		"  -p count     producer threads (1)\n"
+		"  -c count     consumer threads (1)\n"
+		"  -r rate      messages per second over all the producers, 0 - as fast as possible (1000)\n"
+		"  -d seconds   test duration (10)\n"
+		"  -o file      append the received messages to a storage file like " DAEMON_NAME " does\n",
+		name);
+}
+
+int main(int argc, char* argv[])
+{
+	struct options_t options = { NULL, NULL, NULL, 128, 1, 1, 1000, 10 };
+	struct payload_t synthetic = { NULL, 0 };
+	struct payload_t* payloads = &synthetic;
+	ssize_t payload_count = 1;
+	struct producer_t* producers = NULL;
+	struct consumer_t* consumers = NULL;
+	pthread_mutex_t storage_lock = PTHREAD_MUTEX_INITIALIZER;
+	FILE* storage = NULL;
+	int64_t start_ns;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "b:f:s:p:c:r:d:o:h")) != -1)
+	{
+		if (opt == 'b') options.backend = optarg; else
+		if (opt == 'f') options.file = optarg; else
+		if (opt == 's') options.size = strtoul(optarg, NULL, 0); else
+		if (opt == 'p') options.producers = atoi(optarg); else
+		if (opt == 'c') options.consumers = atoi(optarg); else
+		if (opt == 'r') options.rate = atof(optarg); else
+		if (opt == 'd') options.duration = atof(optarg); else
+		if (opt == 'o') options.storage = optarg; else
+		{
+			usage(argv[0]);
+			return EINVAL;
+		}
+	}
+
+	if ((options.producers <= 0) || (options.consumers <= 0) || (options.rate < 0) || (options.duration <= 0))
+	{
+		usage(argv[0]);
+		return EINVAL;
+	}
+
+	if (options.file)
+	{
+		payload_count = payloads_load(options.file, &payloads);
+		if (payload_count <= 0)
+		{
+			fprintf(stderr, "Failed to read messages from [%s]\n", options.file);
+			return EINVAL;
+		}
+	}
+	else
+	{
+		synthetic.size = options.size > sizeof(struct header_t) ? options.size - sizeof(struct header_t) : 0;
+		synthetic.msg = malloc(synthetic.size + 1);
+		if (!synthetic.msg) return ENOMEM;
+		memset(synthetic.msg, 'x', synthetic.size);
+	}
+
+	if (options.storage && !(storage = fopen(options.storage, "ab")))
+	{
+		perror("Failed to open the storage file");
+		return errno;
+	}
+
+	producers = calloc(options.producers, sizeof(struct producer_t));
+	consumers = calloc(options.consumers, sizeof(struct consumer_t));
+	if (!producers || !consumers) return ENOMEM;
+
+	for (i = 0; i < options.consumers; i++)
+	{
+		consumers[i].options = &options;
+		consumers[i].storage = storage;
+		consumers[i].storage_lock = &storage_lock;
+		pthread_create(&consumers[i].thread, NULL, consume, &consumers[i]);
+	}
+
+	start_ns = now_ns() + 100000000LL; // let the consumers block
+	for (i = 0; i < options.producers; i++)
+	{
+		producers[i].options = &options;
+		producers[i].payloads = payloads;
+		producers[i].payload_count = payload_count;
+		producers[i].index = i;
+		producers[i].start_ns = start_ns;
+		pthread_create(&producers[i].thread, NULL, produce, &producers[i]);
+	}
+
+	for (i = 0; i < options.producers; i++) pthread_join(producers[i].thread, NULL);
+
+	if (stop_consumers(&options, consumers) < 0) perror("Failed to stop the consumers");
+	for (i = 0; i < options.consumers; i++) pthread_join(consumers[i].thread, NULL);
+
+	if (storage) fclose(storage);
+
+	report(&options, producers, consumers, start_ns);
+
+	for (i = 0; i < payload_count; i++) free(payloads[i].msg);
+	if (payloads != &synthetic) free(payloads);
+	free(producers);
+	free(consumers);
+
+	return 0;
+}
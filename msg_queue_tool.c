@@ -0,0 +1,461 @@
+#include "msg_queue.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define INDEX_MAGIC  "MQIDX003"
+#define INDEX_SUFFIX ".idx"
+#define INDEX_CHECK  4096 // bytes at each end of the indexed part the index checksum covers
+
+#define ROUND_SIZE  65536  // records scanned per round, the output of a round is kept in memory
+#define MAX_THREADS 256
+
+// Sidecar index: the header followed by the offsets of the records holding the message of every record,
+// back references are resolved, so a message is always at offset + sizeof(size_t)
+struct index_hdr_t
+{
+	char magic[8];
+	uint64_t data_size; // the storage file size the index has been built for
+	uint64_t file_size; // the indexed part of the storage file, a partial record may follow it
+	uint64_t count;
+	uint64_t inode;     // the storage file the index has been built for
+	uint64_t check;     // index_check() of the indexed part, a rewritten file is indexed again
+};
+
+struct storage_t
+{
+	const char* data;
+	size_t size;
+	uint64_t inode;
+	uint64_t* offsets;
+	uint64_t count;
+};
+
+struct options_t
+{
+	int threads;
+	int records; // length-delimited output
+	int invert;
+	uint64_t first;
+	uint64_t count;
+	const char* pattern;
+	size_t pattern_size;
+};
+
+struct chunk_t
+{
+	pthread_t thread;
+	const struct storage_t* storage;
+	const struct options_t* options;
+	int output;
+	uint64_t first;
+	uint64_t last;
+	uint64_t matched;
+	int error;
+	char* out;
+	size_t out_size;
+	size_t out_capacity;
+};
+
+/*
+ * Substring search comparing the first and the last byte of the needle against 16 positions at once,
+ * only the positions where both match are checked with memcmp.
+ */
+const char* find(const char* hay, size_t hay_size, const char* needle, size_t needle_size)
+{
+	size_t i = 0;
+
+	if (!needle_size) return hay;
+	if (needle_size > hay_size) return NULL;
+	if (needle_size == 1) return memchr(hay, needle[0], hay_size);
+
+#ifdef __SSE2__
+	{
+		const __m128i first = _mm_set1_epi8(needle[0]);
+		const __m128i last = _mm_set1_epi8(needle[needle_size - 1]);
+
+		for (; i + needle_size - 1 + 16 <= hay_size; i += 16)
+		{
+			const __m128i block_first = _mm_loadu_si128((const __m128i*)(hay + i));
+			const __m128i block_last = _mm_loadu_si128((const __m128i*)(hay + i + needle_size - 1));
+			unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+
+			while (mask)
+			{
+				int bit = __builtin_ctz(mask);
+				if (!memcmp(hay + i + bit + 1, needle + 1, needle_size - 2)) return hay + i + bit;
+				mask &= mask - 1;
+			}
+		}
+	}
+#endif
+
+	for (; i + needle_size <= hay_size; i++)
+	{
+		if ((hay[i] == needle[0]) && !memcmp(hay + i + 1, needle + 1, needle_size - 1)) return hay + i;
+	}
+	return NULL;
+}
+
+// Returns NULL if the record doesn't fit in the storage file, the index may be stale or corrupted
+const char* record_msg(const struct storage_t* storage, uint64_t pos, size_t* size)
+{
+	uint64_t offset = storage->offsets[pos];
+	const char* record = NULL;
+
+	if ((offset > storage->size) || (storage->size - offset < sizeof(*size))) return NULL;
+
+	record = storage->data + offset;
+	memcpy(size, record, sizeof(*size));
+	if (*size > storage->size - offset - sizeof(*size)) return NULL;
+
+	return record + sizeof(*size);
+}
+
+int out_append(struct chunk_t* chunk, const void* data, size_t size)
+{
+	if (chunk->out_size + size > chunk->out_capacity)
+	{
+		size_t capacity = chunk->out_capacity ? chunk->out_capacity : 65536;
+		char* out;
+
+		while (capacity < chunk->out_size + size) capacity *= 2;
+		out = realloc(chunk->out, capacity);
+		if (!out) return -1;
+
+		chunk->out = out;
+		chunk->out_capacity = capacity;
+	}
+
+	memcpy(chunk->out + chunk->out_size, data, size);
+	chunk->out_size += size;
+	return 0;
+}
+
+void* scan(void* arg)
+{
+	struct chunk_t* chunk = arg;
+	const struct options_t* options = chunk->options;
+	uint64_t pos;
+
+	for (pos = chunk->first; pos < chunk->last; pos++)
+	{
+		size_t size;
+		const char* msg = record_msg(chunk->storage, pos, &size);
+
+		if (!msg)
+		{
+			fprintf(stderr, "Message %llu is out of the storage file, run the index command again\n", (unsigned long long)pos);
+			chunk->error = EIO;
+			break;
+		}
+
+		if (options->pattern && ((find(msg, size, options->pattern, options->pattern_size) != NULL) == options->invert)) continue;
+
+		chunk->matched++;
+		if (!chunk->output) continue;
+
+		if ((options->records && (out_append(chunk, &size, sizeof(size)) < 0))
+			|| (out_append(chunk, msg, size) < 0)
+			|| (!options->records && (out_append(chunk, "\n", 1) < 0)))
+		{
+			perror("Failed to collect the output");
+			chunk->error = ENOMEM;
+			break;
+		}
+	}
+	return NULL;
+}
+
+// Scans [first, first + count) with the threads round by round and writes the output of every round in order,
+// returns 0 or the error of the first failed thread or write
+int run(const struct storage_t* storage, const struct options_t* options, int output, uint64_t* matched)
+{
+	struct chunk_t chunks[MAX_THREADS];
+	uint64_t last = (options->first + options->count < storage->count) ? options->first + options->count : storage->count;
+	uint64_t round;
+	int ret = 0;
+	int i;
+
+	memset(chunks, 0, sizeof(chunks));
+	*matched = 0;
+
+	for (round = options->first; (round < last) && !ret; round += ROUND_SIZE)
+	{
+		uint64_t round_last = (round + ROUND_SIZE < last) ? round + ROUND_SIZE : last;
+		uint64_t step = (round_last - round + options->threads - 1) / options->threads;
+
+		for (i = 0; i < options->threads; i++)
+		{
+			chunks[i].storage = storage;
+			chunks[i].options = options;
+			chunks[i].output = output;
+			chunks[i].first = round + step * i < round_last ? round + step * i : round_last;
+			chunks[i].last = chunks[i].first + step < round_last ? chunks[i].first + step : round_last;
+			chunks[i].out_size = 0;
+			pthread_create(&chunks[i].thread, NULL, scan, &chunks[i]);
+		}
+
+		for (i = 0; i < options->threads; i++)
+		{
+			pthread_join(chunks[i].thread, NULL);
+			if (!ret) ret = chunks[i].error;
+			if (output && !ret && (fwrite(chunks[i].out, 1, chunks[i].out_size, stdout) != chunks[i].out_size))
+			{
+				ret = errno;
+				perror("Failed to write the output");
+			}
+		}
+	}
+
+	for (i = 0; i < options->threads; i++)
+	{
+		*matched += chunks[i].matched;
+		free(chunks[i].out);
+	}
+
+	if (fflush(stdout) && !ret) ret = errno;
+	return ret;
+}
+
+int storage_map(const char* path, struct storage_t* storage)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if ((fd < 0) || (fstat(fd, &st) < 0))
+	{
+		perror(path);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+
+	storage->inode = st.st_ino;
+	storage->size = st.st_size;
+	storage->data = storage->size ? mmap(NULL, storage->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+
+	if (storage->data == MAP_FAILED)
+	{
+		perror("Failed to map the storage file");
+		return -1;
+	}
+
+	if (storage->size) madvise((void*)storage->data, storage->size, MADV_SEQUENTIAL);
+	return 0;
+}
+
+// FNV-1a of both ends of the first size bytes of the storage file, appending to the file doesn't change it
+uint64_t index_check(const struct storage_t* storage, size_t size)
+{
+	size_t tail = (size > INDEX_CHECK) ? size - INDEX_CHECK : 0;
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < size; i++)
+	{
+		if ((i == INDEX_CHECK) && (i < tail)) i = tail;
+		hash = (hash ^ (unsigned char)storage->data[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+ * Builds the index of the storage file or extends it with the records appended since it has been built.
+ * The index is reused for the same file if the part it covers still has the same checksum. The index is
+ * kept in memory, failing to write it only costs the next run a rebuild.
+ */
+int index_update(const char* path, struct storage_t* storage)
+{
+	char* index_path = malloc(strlen(path) + sizeof(INDEX_SUFFIX));
+	char* tmp_path = malloc(strlen(path) + sizeof(INDEX_SUFFIX) + 4);
+	struct index_hdr_t hdr = { INDEX_MAGIC, 0, 0, 0, storage->inode, 0 };
+	uint64_t* offsets = NULL;
+	uint64_t capacity = 0;
+	size_t pos;
+	FILE* index;
+
+	if (!index_path || !tmp_path)
+	{
+		free(index_path);
+		free(tmp_path);
+		return -1;
+	}
+	sprintf(index_path, "%s" INDEX_SUFFIX, path);
+	sprintf(tmp_path, "%s" INDEX_SUFFIX ".tmp", path);
+
+	index = fopen(index_path, "rb");
+	if (index)
+	{
+		struct index_hdr_t old;
+		if ((fread(&old, sizeof(old), 1, index) == 1) && !memcmp(old.magic, INDEX_MAGIC, sizeof(old.magic))
+			&& (old.inode == hdr.inode) && (old.file_size <= storage->size) && (old.count <= old.file_size / sizeof(size_t))
+			&& (old.check == index_check(storage, old.file_size)))
+		{
+			capacity = old.count + 1024;
+			offsets = malloc(capacity * sizeof(uint64_t));
+			if (offsets && (fread(offsets, sizeof(uint64_t), old.count, index) == old.count)) hdr = old;
+			else { free(offsets); offsets = NULL; capacity = 0; }
+		}
+		fclose(index);
+	}
+
+	if (offsets && (hdr.data_size == storage->size)) goto exit;
+
+	for (pos = hdr.file_size; pos + sizeof(size_t) <= storage->size;)
+	{
+		size_t size;
+		memcpy(&size, storage->data + pos, sizeof(size));
+
+		if (hdr.count == capacity)
+		{
+			uint64_t* tmp = realloc(offsets, (capacity = capacity ? 2 * capacity : 65536) * sizeof(uint64_t));
+			if (!tmp) { free(offsets); free(index_path); free(tmp_path); return -1; }
+			offsets = tmp;
+		}
+
+		if (size & MSG_QUEUE_BACKREF)
+		{
+			size &= ~MSG_QUEUE_BACKREF;
+			if (!size || (size > hdr.count)) break;
+			offsets[hdr.count] = offsets[hdr.count - size];
+			pos += sizeof(size);
+		}
+		else
+		{
+			if ((size > MAX_MSG_SIZE) || (pos + sizeof(size) + size > storage->size)) break;
+			offsets[hdr.count] = pos;
+			pos += sizeof(size) + size;
+		}
+		hdr.count++;
+		hdr.file_size = pos;
+	}
+
+	hdr.data_size = storage->size;
+	hdr.check = index_check(storage, hdr.file_size);
+	if (hdr.file_size != storage->size)
+	{
+		fprintf(stderr, "Ignoring %zu byte(s) of a malformed record at the end of the file\n", storage->size - (size_t)hdr.file_size);
+	}
+
+	index = fopen(tmp_path, "wb");
+	if (index)
+	{
+		int failed = (fwrite(&hdr, sizeof(hdr), 1, index) != 1) || (fwrite(offsets, sizeof(uint64_t), hdr.count, index) != hdr.count);
+
+		if (fclose(index) || failed || rename(tmp_path, index_path))
+		{
+			int err = errno;
+			unlink(tmp_path);
+			errno = err;
+			index = NULL;
+		}
+	}
+	if (!index) perror("Failed to write the index, it is only kept in memory");
+
+exit:
+	free(index_path);
+	free(tmp_path);
+
+	storage->offsets = offsets;
+	storage->count = hdr.count;
+	return 0;
+}
+
+int usage(const char* name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] command storage_file [pattern]\n"
+		"Commands:\n"
+		"  index    build or update the sidecar index (storage_file" INDEX_SUFFIX ")\n"
+		"  count    count the messages, the ones containing the pattern if it is given\n"
+		"  cat      print the messages\n"
+		"  grep     print the messages containing the pattern\n"
+		"Options:\n"
+		"  -j n     scan with n threads (the number of CPUs by default)\n"
+		"  -s n     start from the n-th message (0 based)\n"
+		"  -n n     process at most n messages\n"
+		"  -v       select the messages which don't contain the pattern\n"
+		"  -l       print length-delimited storage records instead of newline-delimited messages\n",
+		name);
+	return EINVAL;
+}
+
+int main(int argc, char* argv[])
+{
+	struct options_t options = { (int)sysconf(_SC_NPROCESSORS_ONLN), 0, 0, 0, UINT64_MAX, NULL, 0 };
+	struct storage_t storage;
+	const char* cmd;
+	uint64_t matched = 0;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:s:n:vl")) != -1)
+	{
+		if (opt == 'j') options.threads = atoi(optarg); else
+		if (opt == 's') options.first = strtoull(optarg, NULL, 0); else
+		if (opt == 'n') options.count = strtoull(optarg, NULL, 0); else
+		if (opt == 'v') options.invert = 1; else
+		if (opt == 'l') options.records = 1; else
+		return usage(argv[0]);
+	}
+
+	if ((argc - optind < 2) || (argc - optind > 3)) return usage(argv[0]);
+	if (options.threads < 1) options.threads = 1;
+	if (options.threads > MAX_THREADS) options.threads = MAX_THREADS;
+
+	cmd = argv[optind];
+	if (argc - optind == 3)
+	{
+		options.pattern = argv[optind + 2];
+		options.pattern_size = strlen(options.pattern);
+	}
+	if (options.first > UINT64_MAX - options.count) options.count = UINT64_MAX - options.first;
+
+	memset(&storage, 0, sizeof(storage));
+	if ((storage_map(argv[optind + 1], &storage) < 0) || (index_update(argv[optind + 1], &storage) < 0))
+	{
+		fprintf(stderr, "Failed to open the storage file [%s]\n", argv[optind + 1]);
+		return EIO;
+	}
+
+	if (!strcmp(cmd, "index") && !options.pattern)
+	{
+		printf("%llu\n", (unsigned long long)storage.count);
+	} else
+	if (!strcmp(cmd, "count"))
+	{
+		ret = run(&storage, &options, 0, &matched);
+		if (!ret) printf("%llu\n", (unsigned long long)matched);
+	} else
+	if (!strcmp(cmd, "cat") && !options.pattern)
+	{
+		ret = run(&storage, &options, 1, &matched);
+	} else
+	if (!strcmp(cmd, "grep") && options.pattern)
+	{
+		ret = run(&storage, &options, 1, &matched);
+	}
+	else
+	{
+		return usage(argv[0]);
+	}
+
+	free(storage.offsets);
+	if (storage.size) munmap((void*)storage.data, storage.size);
+
+	return ret;
+}